@@ -21,7 +21,41 @@ import json
 import os
 import sys
 
-standardErrorMap = {0: 'Off', 1: 'Present', 2: 'Confirmed'}
+# Kinds of integer values, see receiver/mapping.h
+KIND_RAW = 0
+KIND_ENUM = 1
+KIND_PROGRAM = 2
+KIND_DURATION = 3
+KIND_PERCENT = 4
+
+programKeys = {
+    'BSH.Common.Root.SelectedProgram',
+    'BSH.Common.Root.ActiveProgram',
+    'LaundryCare.Common.Option.ReferToProgram',
+}
+
+durationKeys = {
+    'BSH.Common.Option.RemainingProgramTime',
+    'BSH.Common.Option.EstimatedTotalProgramTime',
+    'BSH.Common.Option.FinishInRelative',
+}
+
+percentKeys = {
+    'BSH.Common.Option.ProgramProgress',
+}
+
+# The value map of a key is always tried first, so the kind only decides how
+# values without a mapping are expanded.
+def classify(name, hasValues):
+    if name in programKeys:
+        return KIND_PROGRAM
+    if name in durationKeys:
+        return KIND_DURATION
+    if name in percentKeys:
+        return KIND_PERCENT
+    if hasValues:
+        return KIND_ENUM
+    return KIND_RAW
 
 def main(argv):
     loraKey = bytearray(os.urandom(32))
@@ -61,43 +95,134 @@ def main(argv):
                 kvMap[int(vk)] = vd
             valueMap[intKey] = kvMap
 
+    # All strings are stored in a single pool, and referenced by their offset.
+    stringPool = []
+    stringOffsets = {}
+    def addString(text):
+        if text not in stringOffsets:
+            stringOffsets[text] = sum(len(s.encode('UTF-8')) + 1 for s in stringPool)
+            stringPool.append(text)
+        return stringOffsets[text]
+
+    # Identical value maps (e.g. the standard error map) are only stored once.
+    valueSets = []
+    valueSetIndex = {}
+    keyValueSet = {}
+    for key, value in sorted(valueMap.items()):
+        values = tuple(sorted(value.items()))
+        if values not in valueSetIndex:
+            valueSetIndex[values] = len(valueSets)
+            valueSets.append(values)
+        keyValueSet[key] = valueSetIndex[values]
+
+    keyRows = []
+    for key, name in sorted(featureMap.items()):
+        keyRows.append((key, addString(name), keyValueSet.get(key, 0xFFFF), classify(name, key in valueMap)))
+
+    valueRows = []
+    setRows = []
+    for values in valueSets:
+        setRows.append((len(valueRows), len(values)))
+        for vk, vd in values:
+            valueRows.append((vk, addString(vd)))
+
     print('/* THIS FILE WAS AUTO-GENERATED WITH config-converter.py */')
     print('/* All manual changes will be lost. */')
     print()
     print('#include "mapping.h"')
     print()
-    print('String mapKey(uint16_t key) {')
-    print('  switch (key) {')
-    for key, value in sorted(featureMap.items()):
-        print('    case %d: return F("%s");' % (key, value))
-    print('    default: return String(key, DEC);')
-    print('  }')
-    print('}')
+    print('#define NO_VALUES 0xFFFF')
     print()
-    print('String mapIntValue(uint16_t key, int32_t value) {')
-    print('  switch (key) {')
-    for key, value in sorted(valueMap.items()):
-        if value == standardErrorMap:
-            print('    case %d:' % (key))
+    print('typedef struct valueMapping {')
+    print('  int32_t value;')
+    print('  uint32_t name;')
+    print('} ValueMapping;')
+    print()
+    print('typedef struct valueSet {')
+    print('  uint16_t first;')
+    print('  uint16_t count;')
+    print('} ValueSet;')
+    print()
+    print('static const char stringPool[] =')
+    for text in stringPool:
+        print('  "%s\\0"' % cEscape(text))
+    print('  ;')
+    print()
+    print('static const KeyMapping keyMappings[] = {')
+    for key, name, values, kind in keyRows:
+        print('  { %d, %d, %d, %d },' % (key, values, name, kind))
+    print('};')
+    print()
+    print('static const ValueMapping valueMappings[] = {')
+    for vk, name in valueRows:
+        print('  { %d, %d },' % (vk, name))
+    print('  { 0, 0 }')
+    print('};')
+    print()
+    print('static const ValueSet valueSets[] = {')
+    for first, count in setRows:
+        print('  { %d, %d },' % (first, count))
+    print('  { 0, 0 }')
+    print('};')
+    print()
+    print(LOOKUP_FUNCTIONS)
 
-    print('      switch (value) {')
-    for vk, vd in standardErrorMap.items():
-        print('        case %d: return F("%s");' % (vk, vd))
-    print('      }')
-    print('      break;')
+def cEscape(text):
+    result = ''
+    for ch in text.encode('UTF-8'):
+        if ch == ord('"') or ch == ord('\\'):
+            result += '\\' + chr(ch)
+        elif ch < 32 or ch > 126:
+            result += '\\%03o' % ch
+        else:
+            result += chr(ch)
+    return result
 
-    for key, value in sorted(valueMap.items()):
-        if value != standardErrorMap:
-            print('    case %d:' % (key))
-            print('      switch (value) {')
-            for vk, vd in sorted(value.items()):
-                print('        case %d: return F("%s");' % (vk, vd))
-            print('      }')
-            print('      break;')
-    print('  }')
-    print('  return F("");');
-    print('}')
-    print()
+LOOKUP_FUNCTIONS = '''const KeyMapping *findKey(uint16_t key) {
+  int low = 0;
+  int high = sizeof(keyMappings) / sizeof(KeyMapping) - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (keyMappings[mid].key < key) {
+      low = mid + 1;
+    } else if (keyMappings[mid].key > key) {
+      high = mid - 1;
+    } else {
+      return &keyMappings[mid];
+    }
+  }
+  return NULL;
+}
+
+const char *mapKey(uint16_t key) {
+  const KeyMapping *mapping = findKey(key);
+  return mapping != NULL ? mapKeyName(*mapping) : NULL;
+}
+
+const char *mapKeyName(const KeyMapping &mapping) {
+  return stringPool + mapping.name;
+}
+
+const char *mapIntValue(const KeyMapping &mapping, int32_t value) {
+  if (mapping.values == NO_VALUES) {
+    return NULL;
+  }
+
+  const ValueSet &set = valueSets[mapping.values];
+  int low = set.first;
+  int high = set.first + set.count - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (valueMappings[mid].value < value) {
+      low = mid + 1;
+    } else if (valueMappings[mid].value > value) {
+      high = mid - 1;
+    } else {
+      return stringPool + valueMappings[mid].name;
+    }
+  }
+  return NULL;
+}'''
 
 if __name__ == "__main__":
    main(sys.argv[1:])
@@ -0,0 +1,203 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __ArenaBuffer__
+#define __ArenaBuffer__
+
+#include <Arduino.h>
+#include <atomic>
+
+
+/**
+ * Lock-free ring buffer for records of variable length, for a single producer
+ * and a single consumer. N is the capacity in bytes, and must be a power of
+ * two.
+ *
+ * Every record is stored with a length prefix, and aligned to 4 bytes. If a
+ * record does not fit into the end of the buffer, a wrap marker is written
+ * and the record starts at the beginning of the buffer. Records are written
+ * and read in place, like with RingBuffer.
+ */
+template <size_t N>
+class ArenaBuffer {
+  static_assert(N >= 64 && (N & (N - 1)) == 0, "arena size must be a power of two");
+
+  using Header = uint32_t;
+  static const Header WRAP_MARKER = 0xFFFFFFFF;
+
+public:
+  ArenaBuffer() : head(0), tail(0), headCount(0), tailCount(0), highWater(0) {}
+
+  /**
+   * Get a contiguous free area for the next record, with at least minLength
+   * bytes, or NULL if there is not enough room. available is set to the
+   * number of bytes that can actually be used. The record is added to the
+   * buffer by commit(). If headroom is set, that number of bytes is kept
+   * free for other records.
+   * Must only be invoked by the producer.
+   */
+  char *reserve(size_t minLength, size_t &available, size_t headroom = 0) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t used = h - tail.load(std::memory_order_acquire);
+    size_t offset = h & (N - 1);
+    size_t needed = align(sizeof(Header) + minLength);
+
+    // If the end of the buffer is too small, skip it and start over
+    wrapSkip = 0;
+    if (N - offset < needed) {
+      wrapSkip = N - offset;
+      offset = 0;
+    }
+
+    if (used + wrapSkip + needed + headroom > N) {
+      return NULL;
+    }
+
+    size_t free = N - used - wrapSkip;
+    if (free > N - offset) {
+      free = N - offset;
+    }
+    available = free - sizeof(Header);
+    reserved = offset;
+    return buffer + offset + sizeof(Header);
+  }
+
+  /**
+   * Add the record returned by reserve() to the buffer, with the given
+   * length. The length must not exceed the available bytes. Returns the
+   * position of the record, see get().
+   * Must only be invoked by the producer.
+   */
+  uint32_t commit(size_t length) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (wrapSkip > 0) {
+      *(Header *)(buffer + (h & (N - 1))) = WRAP_MARKER;
+    }
+    *(Header *)(buffer + reserved) = length;
+    uint32_t position = h + wrapSkip;
+    h = position + align(sizeof(Header) + length);
+    headCount.store(headCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    head.store(h, std::memory_order_release);
+    updateHighWater(h);
+    return position;
+  }
+
+  /**
+   * Get a committed record by the position returned by commit(), or NULL if
+   * it was already released by the consumer. length is set to the length of
+   * the record. Note that the consumer may release the record at any time.
+   * Must only be invoked by the producer.
+   */
+  char *get(uint32_t position, size_t &length) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t t = tail.load(std::memory_order_acquire);
+    if (position - t >= h - t) {
+      return NULL;
+    }
+    char *record = buffer + (position & (N - 1));
+    length = *(Header *)record;
+    return record + sizeof(Header);
+  }
+
+  /**
+   * Get the oldest record in place, or NULL if the buffer is empty. length
+   * is set to the length of the record. The record stays in the buffer until
+   * release() is invoked.
+   * Must only be invoked by the consumer.
+   */
+  char *peek(size_t &length) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) {
+      return NULL;
+    }
+
+    size_t offset = t & (N - 1);
+    Header header = *(Header *)(buffer + offset);
+    if (header == WRAP_MARKER) {
+      // The record is found at the beginning of the buffer
+      t += N - offset;
+      tail.store(t, std::memory_order_release);
+      offset = 0;
+      header = *(Header *)buffer;
+    }
+
+    length = header;
+    return buffer + offset + sizeof(Header);
+  }
+
+  /**
+   * Remove the record returned by peek() from the buffer.
+   * Must only be invoked by the consumer.
+   */
+  void release() {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    Header header = *(Header *)(buffer + (t & (N - 1)));
+    tailCount.store(tailCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    tail.store(t + align(sizeof(Header) + header), std::memory_order_release);
+  }
+
+  /**
+   * Number of records in the buffer.
+   */
+  size_t count() {
+    return headCount.load(std::memory_order_relaxed) - tailCount.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Number of bytes in use, including headers and padding.
+   */
+  size_t used() {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Maximum number of bytes that were in use at the same time.
+   */
+  size_t getHighWater() {
+    return highWater;
+  }
+
+  /**
+   * Capacity in bytes.
+   */
+  size_t capacity() {
+    return N;
+  }
+
+private:
+  static size_t align(size_t length) {
+    return (length + 3) & ~3;
+  }
+
+  void updateHighWater(uint32_t h) {
+    size_t used = h - tail.load(std::memory_order_relaxed);
+    if (used > highWater) {
+      highWater = used;
+    }
+  }
+
+  alignas(Header) char buffer[N];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> headCount;
+  std::atomic<uint32_t> tailCount;
+  volatile size_t highWater;
+  size_t reserved;
+  size_t wrapSkip;
+};
+
+#endif
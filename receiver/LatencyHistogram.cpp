@@ -0,0 +1,72 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "LatencyHistogram.h"
+
+
+LatencyHistogram::LatencyHistogram() {
+  memset(buckets, 0, sizeof(buckets));
+  count = 0;
+}
+
+void LatencyHistogram::record(unsigned long latency) {
+  buckets[bucketOf(latency)]++;
+  count++;
+}
+
+unsigned long LatencyHistogram::percentile(uint8_t percent) {
+  unsigned long total = count;
+  if (total == 0) {
+    return 0;
+  }
+
+  unsigned long limit = ((uint64_t)total * percent + 99) / 100;
+  unsigned long sum = 0;
+  for (size_t ix = 0; ix < LATENCY_BUCKETS; ix++) {
+    sum += buckets[ix];
+    if (sum >= limit) {
+      return upperBound(ix);
+    }
+  }
+  return upperBound(LATENCY_BUCKETS - 1);
+}
+
+unsigned long LatencyHistogram::getCount() {
+  return count;
+}
+
+size_t LatencyHistogram::bucketOf(unsigned long latency) {
+  // Small values get a bucket of their own
+  if (latency < LATENCY_SUB_BUCKETS) {
+    return latency;
+  }
+
+  // Otherwise use the position of the highest bit, and the bits below it
+  int exponent = 31 - __builtin_clz(latency);
+  size_t sub = (latency >> (exponent - 2)) & (LATENCY_SUB_BUCKETS - 1);
+  size_t bucket = (exponent - 1) * LATENCY_SUB_BUCKETS + sub;
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+unsigned long LatencyHistogram::upperBound(size_t bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  int exponent = bucket / LATENCY_SUB_BUCKETS + 1;
+  size_t sub = bucket % LATENCY_SUB_BUCKETS;
+  return ((LATENCY_SUB_BUCKETS + sub + 1) << (exponent - 2)) - 1;
+}
@@ -0,0 +1,65 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __LatencyHistogram__
+#define __LatencyHistogram__
+
+#include <Arduino.h>
+
+// Every power of two is divided into this number of buckets, so a percentile
+// is accurate to about 25%.
+#define LATENCY_SUB_BUCKETS 4
+
+// Number of buckets. Larger values are counted in the last bucket.
+#define LATENCY_BUCKETS 80
+
+/**
+ * Histogram of latencies in ms, with logarithmic buckets. It needs a fixed
+ * amount of memory, no matter how many values are recorded.
+ *
+ * There must only be a single task recording values. Other tasks may read
+ * the percentiles, but may get slightly inconsistent results.
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+
+  /**
+   * Record a latency.
+   */
+  void record(unsigned long latency);
+
+  /**
+   * Latency that is not exceeded by the given percentage of all recorded
+   * values. Returns 0 if nothing has been recorded yet.
+   */
+  unsigned long percentile(uint8_t percent);
+
+  /**
+   * Number of recorded values.
+   */
+  unsigned long getCount();
+
+private:
+  static size_t bucketOf(unsigned long latency);
+  static unsigned long upperBound(size_t bucket);
+
+  unsigned long buckets[LATENCY_BUCKETS];
+  unsigned long count;
+};
+
+#endif
@@ -18,7 +18,9 @@
 #include <LoRa.h>
 #include <SPI.h>
 
+#include "Log.h"
 #include "LoRaReceiver.h"
+#include "PayloadDecoder.h"
 #include "Utils.h"
 
 #include "config.h"
@@ -33,40 +35,65 @@
 #define LORA_DIO1 35
 #define LORA_DIO2 34
 
-
-static uint16_t readKey(Payload &payload, uint8_t &cursor) {
-  uint16_t result = 0;
-  if (cursor + 2 <= payload.length) {
-    result = (payload.data[cursor] & 0xFF) | ((payload.data[cursor + 1] & 0xFF) << 8);
-    cursor += 2;
+// The radio task preempts the LoRa task whenever the radio needs attention.
+#define RADIO_TASK_PRIORITY 5
+#define RADIO_TASK_CORE 1
+#define RADIO_TASK_STACK_SIZE 4096
+
+#ifndef LORA_RESYNC_RETRY
+#define LORA_RESYNC_RETRY 30000
+#endif
+
+// SNR (in dB) that is considered a perfect signal, and the maximum time to
+// wait for a weaker signal. Then a random number of slots is added, each as
+// long as an acknowledge plus a guard time, so receivers with a similar SNR
+// hear each other's acknowledge. The total must be well below the time the
+// sender waits before repeating a message.
+#define ACK_BACKOFF_SNR 10
+#define MAX_ACK_BACKOFF 300
+#define ACK_BACKOFF_SLOTS 4
+#define ACK_SLOT_GUARD 10
+
+// Maximum time the LoRa task sleeps if there is nothing to do, so resync
+// requests are repeated in time.
+#define LORA_IDLE_WAKEUP 1000
+
+
+static TaskHandle_t dio0Task = NULL;
+static volatile TaskHandle_t loopTask = NULL;
+static volatile bool dio0Raised = false;
+static volatile unsigned long dio0Time = 0;
+
+static void IRAM_ATTR onDio0Rise() {
+  // A package was received. Just wake up the radio task, it does the rest.
+  dio0Raised = true;
+  dio0Time = micros();
+  BaseType_t woken = pdFALSE;
+  if (dio0Task != NULL) {
+    vTaskNotifyGiveFromISR(dio0Task, &woken);
   }
-  return result;
+  portYIELD_FROM_ISR(woken);
 }
 
-static int32_t readInteger(Payload &payload, uint8_t &cursor, size_t len, bool neg) {
-  int32_t result = 0;
-  if (cursor + len <= payload.length) {
-    for (int pos = len - 1; pos >= 0; pos--) {
-      result <<= 8;
-      result |= payload.data[cursor + pos] & 0xFF;
-    }
-    cursor += len;
+static unsigned long ackBackoff(float snr) {
+#ifdef LORA_ACK_BACKOFF
+  // The better the signal, the earlier the acknowledge is sent
+  long backoff = (long)((ACK_BACKOFF_SNR - snr) * LORA_ACK_BACKOFF);
+  if (backoff < 0) {
+    backoff = 0;
   }
-  if (neg) {
-    result = -result;
+  if (backoff > MAX_ACK_BACKOFF) {
+    backoff = MAX_ACK_BACKOFF;
   }
-  return result;
-}
 
-static String readString(Payload &payload, uint8_t &cursor) {
-  size_t strlen = 0;
-  uint8_t *start = payload.data + cursor;
-  while (payload.data[cursor] != 0 && cursor < payload.length) {
-    strlen++;
-    cursor++;
-  }
-  cursor++;  // Also skip null terminator
-  return String(start, strlen);
+  // Receivers with a similar signal pick different slots, so the later one
+  // has heard the complete acknowledge of the earlier one. They still
+  // collide if they pick the same slot.
+  unsigned long slot = loraAirtime(sizeof(Acknowledge), LORA_SPREADING, LORA_BANDWIDTH) + ACK_SLOT_GUARD;
+  return backoff + random(ACK_BACKOFF_SLOTS) * slot;
+#else
+  return 0;
+#endif
 }
 
 LoRaReceiver::LoRaReceiver(const char *base64key) {
@@ -86,6 +113,12 @@ LoRaReceiver::LoRaReceiver(const char *base64key) {
   hmacSha256.update("LORAMAC", 7);
   hmacSha256.finalizeHMAC(key, sizeof(key), mackey, sizeof(mackey));
 
+  // Acknowledges use their own MAC key, so they can never be mistaken for a
+  // payload (and vice versa).
+  hmacSha256.resetHMAC(key, sizeof(key));
+  hmacSha256.update("LORAACK", 7);
+  hmacSha256.finalizeHMAC(key, sizeof(key), ackkey, sizeof(ackkey));
+
   aesEncrypt.clear();
   if (!aesEncrypt.setKey(enckey, aesEncrypt.keySize())) {
     die("LR: Invalid encryption key");
@@ -95,14 +128,36 @@ LoRaReceiver::LoRaReceiver(const char *base64key) {
     die("LR: Invalid decryption key");
   }
 
-  receiverQueue = new cppQueue(sizeof(Encrypted), PAYLOAD_BUFFER_SIZE);
+  decoder = new PayloadDecoder();
+  receiverQueue = new RingBuffer<Encrypted, PAYLOAD_BUFFER_SIZE>();
+  downlinkQueue = new RingBuffer<Acknowledge, DOWNLINK_BUFFER_SIZE>();
+  radioTaskHandle = NULL;
 
-  lastMessageNumber = 0;
+  for (int ix = 0; ix < MAX_SENDERS; ix++) {
+    senders[ix].id = SENDER_BROADCAST;
+    senders[ix].ackPending = false;
+    senders[ix].publishPending = false;
+  }
+  eventListener = NULL;
+
+  receivedCount = 0;
+  droppedCount = 0;
+  rejectedCount = 0;
+  duplicateCount = 0;
+  processedCount = 0;
+  totalLatency = 0;
+  maxLatency = 0;
+  maxAckDelay = 0;
+  downlinkCount = 0;
+  downlinkDroppedCount = 0;
+  airtime = 0;
 }
 
 LoRaReceiver::~LoRaReceiver() {
   LoRa.end();
+  delete downlinkQueue;
   delete receiverQueue;
+  delete decoder;
 }
 
 void LoRaReceiver::connect() {
@@ -114,48 +169,173 @@ void LoRaReceiver::connect() {
   LoRa.setSpreadingFactor(LORA_SPREADING);
   LoRa.setSignalBandwidth(LORA_BANDWIDTH);
   LoRa.setSyncWord(LORA_SYNCWORD);
+
+  // From now on, the radio is only accessed by the radio task
+  xTaskCreatePinnedToCore(radioTask, "radio", RADIO_TASK_STACK_SIZE, this, RADIO_TASK_PRIORITY, &radioTaskHandle, RADIO_TASK_CORE);
+  dio0Task = radioTaskHandle;
+  attachInterrupt(digitalPinToInterrupt(LORA_DIO0), onDio0Rise, RISING);
+#ifdef POWER_SAVE
+  gpio_wakeup_enable((gpio_num_t)LORA_DIO0, GPIO_INTR_HIGH_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+#endif
+
+  // We don't know the current state after a restart, so ask the senders for it
+  requestResync();
+}
+
+void LoRaReceiver::requestResync() {
+  resyncNumber = random(65536);
+  lastResyncTime = millis();
+  for (int ix = 0; ix < MAX_SENDERS; ix++) {
+    senders[ix].synced = false;
+    senders[ix].lastResyncTime = millis();
+  }
+  LOG_INFO("LR: Requesting resync");
+  sendDownlink(ACK_TYPE_RESYNC, SENDER_BROADCAST, resyncNumber);
+}
+
+void LoRaReceiver::radioTask(void *parameter) {
+  LoRaReceiver *receiver = (LoRaReceiver *)parameter;
+
+  // Start continuous receive mode
+  LoRa.receive();
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    if (dio0Raised) {
+      dio0Raised = false;
+      int packetSize = LoRa.parsePacket();
+      if (packetSize) {
+        receiver->onLoRaReceive(packetSize);
+      }
+      LoRa.receive();
+    }
+
+    Acknowledge *downlink;
+    while ((downlink = receiver->downlinkQueue->peek()) != NULL) {
+      receiver->transmitDownlink(*downlink);
+      receiver->downlinkQueue->release();
+    }
+  }
 }
 
-void LoRaReceiver::loop() {
-  int packetSize = LoRa.parsePacket();
-  if (packetSize) {
-    onLoRaReceive(packetSize);
+void LoRaReceiver::transmitDownlink(Acknowledge &encrypted) {
+  LoRa.beginPacket();
+  LoRa.write((uint8_t *)&encrypted, sizeof(encrypted));
+  LoRa.endPacket(true);
+  downlinkCount++;
+  airtime += loraAirtime(sizeof(encrypted), LORA_SPREADING, LORA_BANDWIDTH);
+
+  // beginPacket() fails as long as the radio is transmitting. Sleep meanwhile,
+  // so the main loop can continue.
+  while (!LoRa.beginPacket()) {
+    vTaskDelay(1);
   }
-  yield();
 
-  Encrypted receivedMessage;
-  if (receiverQueue->pop(&receivedMessage)) {
+  // Immediately go back to continuous receive mode
+  LoRa.receive();
+}
+
+unsigned long LoRaReceiver::loop() {
+  loopTask = xTaskGetCurrentTaskHandle();
+
+  Encrypted *receivedMessage;
+  while ((receivedMessage = receiverQueue->peek()) != NULL) {
+    unsigned long latency = micros() - receivedMessage->receivedAt;
+    processedCount++;
+    totalLatency += latency;
+    if (latency > maxLatency) {
+      maxLatency = latency;
+    }
+
     Payload receivedPayload;
-    if (decryptMessage(receivedMessage, receivedPayload)) {
-      processPayload(receivedPayload);
+    Acknowledge receivedAcknowledge;
+    if (decryptMessage(*receivedMessage, receivedPayload)) {
+      receivePayload(receivedPayload, *receivedMessage);
+    } else if (receivedMessage->length == sizeof(Acknowledge)
+               && decryptAcknowledge(receivedMessage->payload, receivedAcknowledge)) {
+      receiveAcknowledge(receivedAcknowledge);
+    } else {
+      LOG_ERROR("LR: Bad HMAC");
+      rejectedCount++;
     }
+    receiverQueue->release();
   }
-  yield();
+
+  bool anySender = false;
+  for (int ix = 0; ix < MAX_SENDERS; ix++) {
+    SenderState &sender = senders[ix];
+    if (sender.id == SENDER_BROADCAST) {
+      continue;
+    }
+    anySender = true;
+    if (sender.ackPending && (long)(millis() - sender.ackTime) >= 0) {
+      unsigned long ackDelay = millis() - sender.ackTime;
+      if (ackDelay > maxAckDelay) {
+        maxAckDelay = ackDelay;
+      }
+      completeAcknowledge(sender);
+    }
+    if (!sender.synced && (millis() - sender.lastResyncTime) > LORA_RESYNC_RETRY) {
+      LOG_INFO("LR: Repeating resync request to sender %u", sender.id);
+      sender.lastResyncTime = millis();
+      sendDownlink(ACK_TYPE_RESYNC, sender.id, resyncNumber);
+    }
+  }
+
+  // As long as no sender has answered, repeat the request to all of them
+  if (!anySender && (millis() - lastResyncTime) > LORA_RESYNC_RETRY) {
+    LOG_INFO("LR: Repeating resync request");
+    lastResyncTime = millis();
+    sendDownlink(ACK_TYPE_RESYNC, SENDER_BROADCAST, resyncNumber);
+  }
+
+  // Sleep until the next acknowledge is due
+  unsigned long wakeup = LORA_IDLE_WAKEUP;
+  for (int ix = 0; ix < MAX_SENDERS; ix++) {
+    SenderState &sender = senders[ix];
+    if (sender.id != SENDER_BROADCAST && sender.ackPending) {
+      long due = (long)(sender.ackTime - millis());
+      wakeup = min(wakeup, (unsigned long)max(due, 0L));
+    }
+  }
+  return wakeup;
 }
 
 void LoRaReceiver::onLoRaReceive(int packetSize) {
+  receivedCount++;
   if (packetSize == 0 || packetSize > sizeof(Payload) || packetSize % 16 != 0) {
-    Serial.printf("LRC: Ignoring message with length %u\n", packetSize);
+    LOG_WARN("LRC: Ignoring message with length %u", packetSize);
     return;
   }
 
-  Encrypted cryptBuffer;
-  cryptBuffer.length = packetSize;
+  // The message is read directly into the next free slot of the queue
+  Encrypted *cryptBuffer = receiverQueue->reserve();
+  if (cryptBuffer == NULL) {
+    LOG_ERROR("LRC: Queue is full, message was dropped!");
+    droppedCount++;
+    return;
+  }
+  cryptBuffer->receivedAt = dio0Time;
+  cryptBuffer->length = packetSize;
+  cryptBuffer->rssi = LoRa.packetRssi();
+  cryptBuffer->snr = LoRa.packetSnr();
 
   size_t receiveLength = 0;
   uint8_t chr;
   while (LoRa.available()) {
     chr = (uint8_t)LoRa.read();
-    if (receiveLength < sizeof(cryptBuffer.payload)) {
-      cryptBuffer.payload[receiveLength++] = chr;
+    if (receiveLength < sizeof(cryptBuffer->payload)) {
+      cryptBuffer->payload[receiveLength++] = chr;
     }
   }
 
-  if (receiverQueue->push(&cryptBuffer)) {
-    Serial.printf("LRC: Received message with length %u\n", packetSize);
-  } else {
-    Serial.println("LRC: Queue is full, message was dropped!");
+  receiverQueue->commit();
+  if (loopTask != NULL) {
+    xTaskNotifyGive(loopTask);
   }
+  LOG_DEBUG("LRC: Received message with length %u", packetSize);
 }
 
 bool LoRaReceiver::decryptMessage(Encrypted &encrypted, Payload &payload) {
@@ -172,27 +352,138 @@ bool LoRaReceiver::decryptMessage(Encrypted &encrypted, Payload &payload) {
   hmacSha256.update(((uint8_t *)&payload) + sizeof(payload.hash), encrypted.length - sizeof(payload.hash));
   hmacSha256.finalizeHMAC(mackey, sizeof(mackey), ourHash, sizeof(ourHash));
 
-  if (0 != memcmp(payload.hash, ourHash, sizeof(ourHash))) {
-    Serial.println("LR: Bad HMAC");
-    return false;
+  return 0 == memcmp(payload.hash, ourHash, sizeof(ourHash));
+}
+
+bool LoRaReceiver::decryptAcknowledge(uint8_t *ackPackage, Acknowledge &unencrypted) {
+  aesDecrypt.decryptBlock((uint8_t *)&unencrypted, ackPackage);
+
+  uint8_t ourHash[sizeof(unencrypted.hash)];
+  hmacSha256.resetHMAC(ackkey, sizeof(ackkey));
+  hmacSha256.update(((uint8_t *)&unencrypted) + sizeof(unencrypted.hash), sizeof(unencrypted) - sizeof(unencrypted.hash));
+  hmacSha256.finalizeHMAC(ackkey, sizeof(ackkey), ourHash, sizeof(ourHash));
+
+  return 0 == memcmp(unencrypted.hash, ourHash, sizeof(ourHash));
+}
+
+void LoRaReceiver::receivePayload(Payload &payload, Encrypted &encrypted) {
+  if (payload.sender == SENDER_BROADCAST) {
+    LOG_WARN("LR: Message without sender ID, ignoring");
+    return;
   }
 
-  // Send acknowledge
-  sendAck(payload.number);
+  SenderState *sender = findSender(payload.sender);
+  bool known = sender != NULL;
+  if (!known) {
+    sender = addSender(payload.sender);
+  }
+
+  sender->lastSeen = millis();
 
-  // Check for duplicate
-  if (payload.number == lastMessageNumber) {
-    Serial.println("LR: Message already received");
-    return false;
+  if (sender->ackPending && payload.number != sender->lastMessageNumber) {
+    // The sender has already moved on, so finish the previous message first
+    completeAcknowledge(*sender);
   }
-  lastMessageNumber = payload.number;
 
-  return true;
+  // A duplicate is acknowledged again, as the sender has obviously missed
+  // the acknowledge. It is not published again though.
+  bool duplicate = known && payload.number == sender->lastMessageNumber;
+  if (duplicate) {
+    LOG_DEBUG("LR: Message from sender %u already received", payload.sender);
+    duplicateCount++;
+  } else {
+    sender->lastMessageNumber = payload.number;
+    sender->publishPending = true;
+    sender->rssi = encrypted.rssi;
+    sender->snr = encrypted.snr;
+
+    // The sender stamped the age of the payload when it started transmitting
+    unsigned long receivedAt = millis() - (micros() - encrypted.receivedAt) / 1000;
+    sender->eventTime = receivedAt - loraAirtime(encrypted.length, LORA_SPREADING, LORA_BANDWIDTH) - payload.age;
+    memcpy(&sender->payload, &payload, sizeof(Payload));
+  }
+
+  // Wait with the acknowledge, another receiver might have a better signal
+  if (!sender->ackPending) {
+    sender->ackPending = true;
+    sender->ackTime = millis() + ackBackoff(encrypted.snr);
+  }
 }
 
-void LoRaReceiver::sendAck(uint16_t messageId) {
+void LoRaReceiver::receiveAcknowledge(Acknowledge &acknowledge) {
+  if (acknowledge.type != ACK_TYPE_ACKNOWLEDGE) {
+    return;
+  }
+
+  // Another receiver was faster, so it also publishes the message
+  SenderState *sender = findSender(acknowledge.sender);
+  if (sender != NULL && sender->ackPending && acknowledge.number == sender->lastMessageNumber) {
+    LOG_DEBUG("LR: Message from sender %u was acknowledged by another receiver", sender->id);
+    sender->ackPending = false;
+    if (sender->publishPending) {
+      sender->publishPending = false;
+      processPayload(*sender, false);
+    }
+  }
+}
+
+void LoRaReceiver::completeAcknowledge(SenderState &sender) {
+  sender.ackPending = false;
+  sendAck(sender.id, sender.lastMessageNumber);
+
+  if (sender.publishPending) {
+    sender.publishPending = false;
+    processPayload(sender, true);
+  }
+}
+
+SenderState *LoRaReceiver::findSender(uint8_t id) {
+  for (int ix = 0; ix < MAX_SENDERS; ix++) {
+    if (senders[ix].id == id) {
+      return &senders[ix];
+    }
+  }
+  return NULL;
+}
+
+SenderState *LoRaReceiver::addSender(uint8_t id) {
+  // Take a free slot, or the one of the sender that was silent the longest
+  SenderState *sender = &senders[0];
+  for (int ix = 0; ix < MAX_SENDERS && sender->id != SENDER_BROADCAST; ix++) {
+    if (senders[ix].id == SENDER_BROADCAST || (millis() - senders[ix].lastSeen) > (millis() - sender->lastSeen)) {
+      sender = &senders[ix];
+    }
+  }
+  if (sender->id != SENDER_BROADCAST) {
+    LOG_WARN("LR: Too many senders, forgetting sender %u", sender->id);
+  }
+
+  LOG_INFO("LR: New sender %u", id);
+  sender->id = id;
+  sender->lastMessageNumber = 0;
+  sender->synced = false;
+  sender->lastSeen = millis();
+  sender->lastResyncTime = millis();
+  sender->ackPending = false;
+  sender->publishPending = false;
+
+  if ((millis() - lastResyncTime) > LORA_RESYNC_RETRY) {
+    // This cannot be an answer to our last request, so ask the sender directly
+    sendDownlink(ACK_TYPE_RESYNC, id, resyncNumber);
+  }
+
+  return sender;
+}
+
+void LoRaReceiver::sendAck(uint8_t sender, uint16_t messageId) {
+  sendDownlink(ACK_TYPE_ACKNOWLEDGE, sender, messageId);
+}
+
+void LoRaReceiver::sendDownlink(uint8_t type, uint8_t sender, uint16_t number) {
   Acknowledge acknowledge;
-  acknowledge.number = messageId;
+  acknowledge.number = number;
+  acknowledge.sender = sender;
+  acknowledge.type = type;
 
   // Fill padding with random bytes
   for (int ix = 0; ix < sizeof(acknowledge.pad); ix++) {
@@ -200,120 +491,100 @@ void LoRaReceiver::sendAck(uint16_t messageId) {
   }
 
   // Calculate hash
-  hmacSha256.resetHMAC(mackey, sizeof(mackey));
+  hmacSha256.resetHMAC(ackkey, sizeof(ackkey));
   hmacSha256.update(((uint8_t *)&acknowledge) + sizeof(acknowledge.hash), sizeof(acknowledge) - sizeof(acknowledge.hash));
-  hmacSha256.finalizeHMAC(mackey, sizeof(mackey), acknowledge.hash, sizeof(acknowledge.hash));
+  hmacSha256.finalizeHMAC(ackkey, sizeof(ackkey), acknowledge.hash, sizeof(acknowledge.hash));
 
-  // Encrypt
-  uint8_t ackEncrypted[sizeof(acknowledge)];
-  aesEncrypt.encryptBlock(ackEncrypted, (uint8_t *)&acknowledge);
+  // Encrypt into the downlink queue, the radio task will send it
+  Acknowledge *ackEncrypted = downlinkQueue->reserve();
+  if (ackEncrypted == NULL) {
+    LOG_ERROR("LR: Downlink queue is full, acknowledge was dropped!");
+    downlinkDroppedCount++;
+    return;
+  }
+  aesEncrypt.encryptBlock((uint8_t *)ackEncrypted, (uint8_t *)&acknowledge);
+  downlinkQueue->commit();
+  xTaskNotifyGive(radioTaskHandle);
+}
 
-  // Send
-  LoRa.beginPacket();
-  LoRa.write(ackEncrypted, sizeof(ackEncrypted));
-  LoRa.endPacket();
-  yield();
-}
-
-void LoRaReceiver::processPayload(Payload &payload) {
-  uint8_t cursor = 0;
-  while (cursor < payload.length) {
-    uint8_t type = payload.data[cursor++];
-    switch (type) {
-      case 0:  // int, constant zero
-        {
-          uint16_t key = readKey(payload, cursor);
-          if (intEventListener) {
-            intEventListener(key, 0);
-          }
-        }
-        break;
-
-      case 1:  // uint8_t positive
-      case 2:  // uint8_t negative
-        {
-          uint16_t key = readKey(payload, cursor);
-          int32_t value = readInteger(payload, cursor, 1, type == 2);
-          if (intEventListener) {
-            intEventListener(key, value);
-          }
-        }
-        break;
-
-      case 3:  // uint16_t positive
-      case 4:  // uint16_t negative
-        {
-          uint16_t key = readKey(payload, cursor);
-          int32_t value = readInteger(payload, cursor, 2, type == 4);
-          if (intEventListener) {
-            intEventListener(key, value);
-          }
-        }
-        break;
-
-      case 5:  // uint32_t positive
-      case 6:  // uint32_t negative
-        {
-          uint16_t key = readKey(payload, cursor);
-          int32_t value = readInteger(payload, cursor, 4, type == 6);
-          if (intEventListener) {
-            intEventListener(key, value);
-          }
-        }
-        break;
-
-      case 7:  // boolean "false"
-      case 8:  // boolean "true"
-        {
-          uint16_t key = readKey(payload, cursor);
-          if (booleanEventListener) {
-            booleanEventListener(key, type == 8);
-          }
-        }
-        break;
-
-      case 9:  // String
-        {
-          uint16_t key = readKey(payload, cursor);
-          String str = readString(payload, cursor);
-          if (stringEventListener) {
-            stringEventListener(key, str);
-          }
-        }
-        break;
-
-      case 255:  // System message
-        {
-          String str = readString(payload, cursor);
-          if (systemMessageEventListener) {
-            systemMessageEventListener(str);
-          }
-        }
-        break;
-
-      default:
-        Serial.printf("LR: Unknown message type %u, ignoring rest of message\n", type);
-        return;
-    }
+void LoRaReceiver::processPayload(SenderState &sender, bool publish) {
+  // The payload is decoded as a whole, or not at all
+  if (!decoder->decode(sender.payload, sender.rssi, sender.snr, sender.eventTime)) {
+    LOG_WARN("LR: Malformed message from sender %u, ignoring", sender.id);
+    return;
+  }
+
+  if (decoder->hasResyncStartMarker() && !sender.synced && decoder->getResyncStartNumber() == resyncNumber) {
+    // The sender is working on our request, so give the snapshot time to complete
+    sender.lastResyncTime = millis();
+  }
+
+  if (decoder->hasResyncMarker() && !sender.synced && decoder->getResyncNumber() == resyncNumber) {
+    LOG_INFO("LR: Resync of sender %u completed", sender.id);
+    sender.synced = true;
+  }
+
+  if (publish && eventListener && decoder->getCount() > 0) {
+    eventListener(decoder->getEvents(), decoder->getCount());
   }
 }
 
-int LoRaReceiver::getRssi() {
-  return LoRa.rssi();
+unsigned long LoRaReceiver::getReceivedCount() {
+  return receivedCount;
+}
+
+unsigned long LoRaReceiver::getDroppedCount() {
+  return droppedCount;
+}
+
+unsigned long LoRaReceiver::getRejectedCount() {
+  return rejectedCount;
+}
+
+unsigned long LoRaReceiver::getDuplicateCount() {
+  return duplicateCount;
 }
 
-void LoRaReceiver::onReceiveInt(ReceiveIntEvent intEventListener) {
-  this->intEventListener = intEventListener;
+unsigned long LoRaReceiver::getAverageLatency() {
+  return processedCount > 0 ? (unsigned long)(totalLatency / processedCount) : 0;
+}
+
+unsigned long LoRaReceiver::getMaxLatency() {
+  return maxLatency;
+}
+
+unsigned long LoRaReceiver::getMaxAckDelay() {
+  return maxAckDelay;
+}
+
+unsigned long LoRaReceiver::getDownlinkCount() {
+  return downlinkCount;
+}
+
+unsigned long LoRaReceiver::getDownlinkDroppedCount() {
+  return downlinkDroppedCount;
+}
+
+bool LoRaReceiver::isBusy() {
+  if (receiverQueue->count() > 0 || downlinkQueue->count() > 0) {
+    return true;
+  }
+  for (int ix = 0; ix < MAX_SENDERS; ix++) {
+    if (senders[ix].id != SENDER_BROADCAST && senders[ix].ackPending) {
+      return true;
+    }
+  }
+  return false;
 }
 
-void LoRaReceiver::onReceiveBoolean(ReceiveBooleanEvent booleanEventListener) {
-  this->booleanEventListener = booleanEventListener;
+size_t LoRaReceiver::getQueueHighWater() {
+  return receiverQueue->getHighWater();
 }
 
-void LoRaReceiver::onReceiveString(ReceiveStringEvent stringEventListener) {
-  this->stringEventListener = stringEventListener;
+unsigned long LoRaReceiver::getAirtime() {
+  return airtime;
 }
 
-void LoRaReceiver::onReceiveSystemMessage(ReceiveSystemMessageEvent systemMessageEventListener) {
-  this->systemMessageEventListener = systemMessageEventListener;
+void LoRaReceiver::onReceive(ReceiveEvent eventListener) {
+  this->eventListener = eventListener;
 }
@@ -21,9 +21,12 @@
 #include <AES.h>
 #include <Arduino.h>
 #include <assert.h>
-#include <cppQueue.h>
 #include <SHA256.h>
 
+#include "RingBuffer.h"
+
+class PayloadDecoder;
+
 
 // Must be a multiple of 16. In the European Union, the maximum permitted LoRa
 // payload size over all data rates is 51 bytes, so the next smaller payload
@@ -37,35 +40,121 @@
 // Maximum number of payloads to keep in the buffer.
 #define PAYLOAD_BUFFER_SIZE 32
 
+// Maximum number of acknowledges and requests waiting to be sent, must be a
+// power of two.
+#define DOWNLINK_BUFFER_SIZE 8
+
+// Maximum number of senders that are served by the receiver. If more senders
+// are heard, the one that has been silent for the longest time is forgotten.
+#define MAX_SENDERS 8
+
 
 typedef struct payload {
   uint8_t hash[4];  // MUST be the first element!
   uint16_t number;
+  uint8_t sender;
   uint8_t length;
-  uint8_t data[MAX_PAYLOAD_SIZE - sizeof(hash) - sizeof(number) - sizeof(length)];
+  uint16_t age;  // ms since the oldest entry was created, at transmission
+  uint8_t data[MAX_PAYLOAD_SIZE - sizeof(hash) - sizeof(number) - sizeof(sender) - sizeof(length) - sizeof(age)];
 } Payload;
 static_assert(sizeof(struct payload) == MAX_PAYLOAD_SIZE, "payload structure does not have expected size");
 
 typedef struct encrypted {
   uint8_t payload[sizeof(Payload)];
   size_t length;
+  int rssi;
+  float snr;
+  unsigned long receivedAt;  // micros() when the radio raised DIO0
 } Encrypted;
 
+// Types of the packages that are sent by the receiver.
+#define ACK_TYPE_ACKNOWLEDGE 0
+#define ACK_TYPE_RESYNC 1
+
+// Sender ID for addressing all senders.
+#define SENDER_BROADCAST 0
+
 typedef struct acknowledge {
   uint8_t hash[4];  // MUST be the first element!
   uint16_t number;
-  uint8_t pad[MAX_ACK_SIZE - sizeof(hash) - sizeof(number)];
+  uint8_t sender;
+  uint8_t type;
+  uint8_t pad[MAX_ACK_SIZE - sizeof(hash) - sizeof(number) - sizeof(sender) - sizeof(type)];
 } Acknowledge;
 static_assert(sizeof(struct acknowledge) == MAX_ACK_SIZE, "acknowledge structure does not have expected size");
 
+// Link statistics of a sender. They are sent as payload entry of type 253,
+// followed by this structure.
+typedef struct senderStats {
+  uint32_t uptime;   // s
+  uint32_t sent;     // transmissions, including retries
+  uint32_t retried;
+  uint32_t airtime;  // ms
+  uint16_t dropped;  // payloads that were never acknowledged, or did not fit into the queue
+  uint16_t droppedEvents;
+  uint16_t badAcks;  // acknowledges with bad HMAC
+  uint16_t ackLatency;  // average time from transmission until acknowledge, ms
+  uint16_t maxAckLatency;
+  uint8_t payloadQueueHighWater;
+  uint8_t eventQueueHighWater;
+} SenderStats;
+static_assert(sizeof(struct senderStats) == 28, "sender stats structure does not have expected size");
+
+// Types of received events.
+#define EVENT_INT 0
+#define EVENT_BOOLEAN 1
+#define EVENT_STRING 2
+#define EVENT_SYSTEM_MESSAGE 3
+#define EVENT_SENDER_STATS 4
+
+typedef struct loraEvent {
+  uint8_t type;        // EVENT_*
+  uint16_t key;        // not used by EVENT_SYSTEM_MESSAGE
+  int32_t value;       // EVENT_INT, and 0 or 1 for EVENT_BOOLEAN
+  const char *text;    // EVENT_STRING and EVENT_SYSTEM_MESSAGE, NOT null terminated
+  uint8_t textLength;
+  const SenderStats *stats;  // EVENT_SENDER_STATS
+  uint8_t sender;      // link metadata of the package that contained the event
+  uint16_t number;
+  int rssi;
+  float snr;
+  unsigned long time;  // millis() when the event was created at the sender (estimated)
+} LoRaEvent;
+
+typedef struct senderState {
+  uint8_t id;  // SENDER_BROADCAST if unused
+  uint16_t lastMessageNumber;
+  bool synced;
+  unsigned long lastSeen;
+  unsigned long lastResyncTime;
+  bool ackPending;      // acknowledge of lastMessageNumber is waiting to be sent
+  bool publishPending;  // payload is published when the acknowledge is sent
+  unsigned long ackTime;
+  int rssi;
+  float snr;
+  unsigned long eventTime;
+  Payload payload;
+} SenderState;
+
 /**
  * LoRa Connection
+ *
+ * The radio is kept in continuous receive mode. A high priority task reads
+ * received packages into a queue, and sends acknowledges, so loop() never
+ * waits for the radio. loop() should be invoked by a task of its own, so it
+ * is not delayed by anything else. The task is notified when a package was
+ * received, so it can sleep meanwhile.
+ *
+ * If several receivers hear the same sender, only the first one to send an
+ * acknowledge publishes the message. The others overhear that acknowledge and
+ * drop their copy.
+ *
+ * The entries of a payload are passed to the listener as an array of
+ * LoRaEvent. Strings are not copied, but point into the received payload, so
+ * they are only valid while the listener is running.
  */
 class LoRaReceiver {
-  using ReceiveIntEvent = void (*)(const uint16_t key, const int32_t value);
-  using ReceiveBooleanEvent = void (*)(const uint16_t key, const bool value);
-  using ReceiveStringEvent = void (*)(const uint16_t key, const String value);
-  using ReceiveSystemMessageEvent = void (*)(const String value);
+  using ReceiveEvent = void (*)(const LoRaEvent *events, size_t count);
 
 public:
   /**
@@ -84,55 +173,135 @@ public:
   void connect();
 
   /**
-   * Callback when an integer was received.
+   * Callback when a payload was received. It gets all values and system
+   * messages of the payload at once. It is invoked by loop().
+   */
+  void onReceive(ReceiveEvent eventListener);
+
+  /**
+   * Ask all senders to send a snapshot of their current values. The request
+   * is repeated for every sender until its snapshot was received.
    */
-  void onReceiveInt(ReceiveIntEvent intEventListener);
+  void requestResync();
 
   /**
-   * Callback when a boolean was received.
+   * Processes all received packages, and sends pending acknowledges. Returns
+   * the number of ms until loop() needs to be invoked again, if the task is
+   * not notified earlier.
    */
-  void onReceiveBoolean(ReceiveBooleanEvent booleanEventListener);
+  unsigned long loop();
 
   /**
-   * Callback when a String was received.
+   * Returns true if received packages are waiting for processing, or
+   * acknowledges are waiting to be sent. Other tasks should not stall the
+   * CPU meanwhile, e.g. by erasing flash memory.
    */
-  void onReceiveString(ReceiveStringEvent stringEventListener);
+  bool isBusy();
 
   /**
-   * Callback when a general system message was received.
+   * Number of packages that were received by the radio.
    */
-  void onReceiveSystemMessage(ReceiveSystemMessageEvent systemMessageEventListener);
+  unsigned long getReceivedCount();
 
   /**
-   * Invoked in main loop.
+   * Number of packages that were dropped because the queue was full.
    */
-  void loop();
+  unsigned long getDroppedCount();
 
   /**
-   * Return the current RSSI.
+   * Number of packages that were rejected because of a bad HMAC.
    */
-  int getRssi();
+  unsigned long getRejectedCount();
+
+  /**
+   * Number of messages that were received again, because the sender has
+   * missed the acknowledge.
+   */
+  unsigned long getDuplicateCount();
+
+  /**
+   * Average time between the radio signalling a package and processing it,
+   * in us.
+   */
+  unsigned long getAverageLatency();
+
+  /**
+   * Maximum time between the radio signalling a package and processing it,
+   * in us.
+   */
+  unsigned long getMaxLatency();
+
+  /**
+   * Maximum time an acknowledge was sent later than planned, in ms.
+   */
+  unsigned long getMaxAckDelay();
+
+  /**
+   * Number of acknowledges and requests that were transmitted.
+   */
+  unsigned long getDownlinkCount();
+
+  /**
+   * Number of acknowledges and requests that were dropped because the
+   * downlink queue was full.
+   */
+  unsigned long getDownlinkDroppedCount();
+
+  /**
+   * Maximum number of packages that have been waiting for processing.
+   */
+  size_t getQueueHighWater();
+
+  /**
+   * Total airtime of all transmissions, in ms.
+   */
+  unsigned long getAirtime();
 
 private:
+  static void radioTask(void *parameter);
   void onLoRaReceive(int packetSize);
+  void transmitDownlink(Acknowledge &encrypted);
   bool decryptMessage(Encrypted &encrypted, Payload &payload);
-  void processPayload(Payload &payload);
-  void sendAck(uint16_t messageId);
+  bool decryptAcknowledge(uint8_t *ackPackage, Acknowledge &unencrypted);
+  void receivePayload(Payload &payload, Encrypted &encrypted);
+  void receiveAcknowledge(Acknowledge &acknowledge);
+  void completeAcknowledge(SenderState &sender);
+  void processPayload(SenderState &sender, bool publish);
+  void sendAck(uint8_t sender, uint16_t messageId);
+  void sendDownlink(uint8_t type, uint8_t sender, uint16_t number);
+  SenderState *findSender(uint8_t id);
+  SenderState *addSender(uint8_t id);
 
-  uint16_t lastMessageNumber;
+  SenderState senders[MAX_SENDERS];
+
+  uint16_t resyncNumber;
+  unsigned long lastResyncTime;
+
+  unsigned long receivedCount;
+  unsigned long droppedCount;
+  unsigned long rejectedCount;
+  unsigned long duplicateCount;
+  unsigned long processedCount;
+  uint64_t totalLatency;
+  unsigned long maxLatency;
+  unsigned long maxAckDelay;
+  unsigned long downlinkCount;
+  unsigned long downlinkDroppedCount;
+  unsigned long airtime;
 
   uint8_t enckey[SHA256::HASH_SIZE];
   uint8_t mackey[SHA256::HASH_SIZE];
+  uint8_t ackkey[SHA256::HASH_SIZE];
   AES256 aesEncrypt;
   AES256 aesDecrypt;
   SHA256 hmacSha256;
 
-  ReceiveIntEvent intEventListener;
-  ReceiveBooleanEvent booleanEventListener;
-  ReceiveStringEvent stringEventListener;
-  ReceiveSystemMessageEvent systemMessageEventListener;
+  ReceiveEvent eventListener;
+  PayloadDecoder *decoder;
 
-  cppQueue *receiverQueue;
+  RingBuffer<Encrypted, PAYLOAD_BUFFER_SIZE> *receiverQueue;
+  RingBuffer<Acknowledge, DOWNLINK_BUFFER_SIZE> *downlinkQueue;
+  TaskHandle_t radioTaskHandle;
 };
 
 #endif
@@ -0,0 +1,88 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __Log__
+#define __Log__
+
+#include <Arduino.h>
+
+#include "config.h"
+
+#define LOG_LEVEL_OFF 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Maximum number of log records waiting for output, must be a power of two.
+#define LOG_BUFFER_SIZE 64
+
+// Maximum size of the arguments of a log record. Strings are truncated if
+// they do not fit.
+#define LOG_ARGS_SIZE 80
+
+/**
+ * Start the task that writes the log records to Serial. Records that are
+ * written before are kept until then, as long as there is room.
+ */
+void logBegin();
+
+/**
+ * Queue a log record. Only the format and a copy of the arguments are stored,
+ * so it takes a few us. The log task formats and prints the message later. A
+ * newline is added. The format must be a string literal, as it is used after
+ * the call has returned.
+ *
+ * Use the LOG_* macros instead, so the call is removed at compile time if its
+ * level is disabled.
+ */
+void logWrite(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Number of log records that were dropped because the buffer was full.
+ */
+unsigned long logGetDroppedCount();
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logWrite(__VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logWrite(__VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logWrite(__VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logWrite(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "Log.h"
+#include "MessageQueue.h"
+
+#define MESSAGE_READY 0
+#define MESSAGE_WRITING 1  // replaced by the producer
+#define MESSAGE_SENDING 2  // peeked by the consumer
+#define MESSAGE_DEAD 3     // replaced by a message further down the queue
+
+
+MessageQueue::MessageQueue(uint8_t format, bool compactKeys) : writer(format, compactKeys) {
+  memset(index, 0, sizeof(index));
+  memset(seen, 0, sizeof(seen));
+  reservedRecord = NULL;
+  currentUid = NO_UID;
+  replacedCount = 0;
+  droppedCount = 0;
+}
+
+MessageWriter *MessageQueue::open(int32_t uid, uint8_t sender, unsigned long time) {
+  currentUid = uid;
+  currentSender = sender;
+  currentTime = time;
+
+  // The headroom is only available to messages that must not be dropped
+  bool privileged = uid == NO_UID || !isSeen(uid);
+  size_t available;
+  reservedRecord = arena.reserve(sizeof(MessageHeader) + MESSAGE_MIN_SPACE, available,
+                                 privileged ? 0 : MESSAGE_QUEUE_HEADROOM);
+  if (reservedRecord != NULL) {
+    reservedLength = available;
+    writer.begin(reservedRecord + sizeof(MessageHeader), available - sizeof(MessageHeader));
+  } else if (uid != NO_UID) {
+    // The queue is full, but the message may still replace a pending one
+    writer.begin(scratch, sizeof(scratch));
+  } else {
+    droppedCount++;
+    LOG_ERROR("MQ: JSON queue is full, message was dropped!");
+    return NULL;
+  }
+  return &writer;
+}
+
+bool MessageQueue::post() {
+  size_t length = writer.end();
+  if (length == 0) {
+    LOG_ERROR("MQ: JSON message exceeded buffer and was dropped!");
+    return false;
+  }
+
+  const char *message = reservedRecord != NULL ? reservedRecord + sizeof(MessageHeader) : scratch;
+  if (currentUid != NO_UID && replace(message, length, reservedRecord != NULL)) {
+    replacedCount++;
+    return true;
+  }
+
+  if (reservedRecord == NULL) {
+    droppedCount++;
+    LOG_ERROR("MQ: JSON queue is full, message was dropped!");
+    return false;
+  }
+
+  MessageHeader *header = (MessageHeader *)reservedRecord;
+  header->state.store(MESSAGE_READY, std::memory_order_relaxed);
+  header->sender = currentSender;
+  header->uid = currentUid;
+  header->length = length;
+  header->time = currentTime;
+  size_t recordLength = sizeof(MessageHeader) + length + 1;  // including null terminator
+  if (recordLength + MESSAGE_SLACK <= reservedLength) {
+    recordLength += MESSAGE_SLACK;
+  }
+  uint32_t position = arena.commit(recordLength);
+
+  if (currentUid != NO_UID) {
+    IndexEntry &entry = index[(currentUid + currentSender * 31) & (MESSAGE_INDEX_SIZE - 1)];
+    entry.valid = true;
+    entry.sender = currentSender;
+    entry.uid = currentUid;
+    entry.position = position;
+    markSeen(currentUid);
+  }
+  return true;
+}
+
+bool MessageQueue::replace(const char *message, size_t length, bool canAppend) {
+  IndexEntry &entry = index[(currentUid + currentSender * 31) & (MESSAGE_INDEX_SIZE - 1)];
+  if (!entry.valid || entry.uid != currentUid || entry.sender != currentSender) {
+    return false;
+  }
+
+  size_t recordLength;
+  char *record = arena.get(entry.position, recordLength);
+  if (record == NULL) {
+    // Already sent
+    entry.valid = false;
+    return false;
+  }
+
+  // Lock the pending message, unless the consumer is just sending it
+  MessageHeader *header = (MessageHeader *)record;
+  uint8_t expected = MESSAGE_READY;
+  if (!header->state.compare_exchange_strong(expected, MESSAGE_WRITING, std::memory_order_acquire)) {
+    entry.valid = false;
+    return false;
+  }
+
+  if (length + 1 <= recordLength - sizeof(MessageHeader)) {
+    memcpy(record + sizeof(MessageHeader), message, length + 1);
+    header->length = length;
+    header->time = currentTime;
+    header->state.store(MESSAGE_READY, std::memory_order_release);
+    return true;
+  }
+
+  // The new message does not fit, so it is appended and the pending one is
+  // dropped. If it cannot be appended, keep the pending one.
+  header->state.store(canAppend ? MESSAGE_DEAD : MESSAGE_READY, std::memory_order_release);
+  return false;
+}
+
+const char *MessageQueue::peek(size_t &length, int32_t &uid, uint8_t &sender, unsigned long &time) {
+  size_t recordLength;
+  char *record;
+  while ((record = arena.peek(recordLength)) != NULL) {
+    MessageHeader *header = (MessageHeader *)record;
+    uint8_t expected = MESSAGE_READY;
+    if (header->state.compare_exchange_strong(expected, MESSAGE_SENDING, std::memory_order_acquire)
+        || expected == MESSAGE_SENDING) {
+      length = header->length;
+      uid = header->uid;
+      sender = header->sender;
+      time = header->time;
+      return record + sizeof(MessageHeader);
+    }
+    if (expected != MESSAGE_DEAD) {
+      // The producer is replacing the message right now
+      return NULL;
+    }
+    arena.release();
+  }
+  return NULL;
+}
+
+void MessageQueue::release() {
+  arena.release();
+}
+
+size_t MessageQueue::count() {
+  return arena.count();
+}
+
+size_t MessageQueue::used() {
+  return arena.used();
+}
+
+size_t MessageQueue::capacity() {
+  return arena.capacity();
+}
+
+size_t MessageQueue::getHighWater() {
+  return arena.getHighWater();
+}
+
+unsigned long MessageQueue::getReplacedCount() {
+  return replacedCount;
+}
+
+unsigned long MessageQueue::getDroppedCount() {
+  return droppedCount;
+}
+
+bool MessageQueue::isSeen(uint16_t uid) {
+  return (seen[uid / 32] & (1UL << (uid % 32))) != 0;
+}
+
+void MessageQueue::markSeen(uint16_t uid) {
+  seen[uid / 32] |= 1UL << (uid % 32);
+}
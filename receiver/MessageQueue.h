@@ -0,0 +1,157 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MessageQueue__
+#define __MessageQueue__
+
+#include <Arduino.h>
+#include <atomic>
+
+#include "ArenaBuffer.h"
+#include "MessageWriter.h"
+
+// Size of the queue for outgoing MQTT messages, in bytes. A new message is
+// only started if there are at least MESSAGE_MIN_SPACE bytes left.
+#define MESSAGE_QUEUE_SIZE 32768
+#define MESSAGE_MIN_SPACE 256
+
+// Bytes that are kept free for system messages and keys that were not seen
+// before, so they are not dropped if the queue is full of other messages.
+#define MESSAGE_QUEUE_HEADROOM 2048
+
+// Spare bytes after each message, so a replacing message may be a little
+// longer than the pending one.
+#define MESSAGE_SLACK 8
+
+// Number of entries in the index of pending messages, must be a power of two.
+#define MESSAGE_INDEX_SIZE 256
+
+// UID of messages that are never replaced, like system messages.
+#define NO_UID -1
+
+typedef struct messageHeader {
+  std::atomic<uint8_t> state;
+  uint8_t sender;
+  int32_t uid;
+  uint32_t length;
+  uint32_t time;  // millis() when the event was created at the sender
+} MessageHeader;
+
+/**
+ * Queue of outgoing MQTT messages.
+ *
+ * If a message of a key is still waiting in the queue when a new message of
+ * the same key is posted, the pending message is replaced by the new one. If
+ * the MQTT server is unavailable, the queue fills up with the latest state of
+ * each key, rather than with its history.
+ *
+ * There must only be a single producer and a single consumer.
+ */
+class MessageQueue {
+public:
+  /**
+   * Constructor. format and compactKeys are passed to the MessageWriter.
+   */
+  MessageQueue(uint8_t format, bool compactKeys);
+
+  /**
+   * Start a new message for the given key (or NO_UID) of the given sender.
+   * time is the time of the event, for measuring the latency. Returns a
+   * writer for the message, or NULL if the message cannot be queued.
+   * Must only be invoked by the producer.
+   */
+  MessageWriter *open(int32_t uid, uint8_t sender, unsigned long time);
+
+  /**
+   * Queue the message that was started by open(). Returns false if the
+   * message was dropped.
+   * Must only be invoked by the producer.
+   */
+  bool post();
+
+  /**
+   * Get the oldest message in place, or NULL if there is none. length is set
+   * to the length of the message, which is also null terminated. uid, sender
+   * and time are set to the values given on open(). The message stays in the
+   * queue until release() is invoked.
+   * Must only be invoked by the consumer.
+   */
+  const char *peek(size_t &length, int32_t &uid, uint8_t &sender, unsigned long &time);
+
+  /**
+   * Remove the message returned by peek() from the queue.
+   * Must only be invoked by the consumer.
+   */
+  void release();
+
+  /**
+   * Number of messages in the queue, including replaced ones.
+   */
+  size_t count();
+
+  /**
+   * Number of bytes in use.
+   */
+  size_t used();
+
+  /**
+   * Capacity in bytes.
+   */
+  size_t capacity();
+
+  /**
+   * Maximum number of bytes that were in use at the same time.
+   */
+  size_t getHighWater();
+
+  /**
+   * Number of messages that replaced a pending message.
+   */
+  unsigned long getReplacedCount();
+
+  /**
+   * Number of messages that were dropped because the queue was full.
+   */
+  unsigned long getDroppedCount();
+
+private:
+  bool replace(const char *message, size_t length, bool canAppend);
+  bool isSeen(uint16_t uid);
+  void markSeen(uint16_t uid);
+
+  typedef struct indexEntry {
+    bool valid;
+    uint8_t sender;
+    uint16_t uid;
+    uint32_t position;
+  } IndexEntry;
+
+  ArenaBuffer<MESSAGE_QUEUE_SIZE> arena;
+  MessageWriter writer;
+  IndexEntry index[MESSAGE_INDEX_SIZE];
+  uint32_t seen[65536 / 32];
+  char scratch[MESSAGE_MIN_SPACE];
+  char *reservedRecord;
+  size_t reservedLength;
+  int32_t currentUid;
+  uint8_t currentSender;
+  unsigned long currentTime;
+  unsigned long replacedCount;
+  unsigned long droppedCount;
+};
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "Log.h"
+#include "MessageSpool.h"
+
+
+MessageSpool::MessageSpool() {
+  mounted = false;
+  removedSegment = 0;
+  firstSegment = 0;
+  nextSegment = 0;
+  writeOpen = false;
+  writeSize = 0;
+  readOpen = false;
+  hasRecord = false;
+  evictedSegmentCount = 0;
+  maxStall = 0;
+}
+
+bool MessageSpool::begin() {
+  if (!LittleFS.begin(true)) {
+    LOG_ERROR("SP: Could not mount file system, spool is disabled");
+    return false;
+  }
+  if (!LittleFS.exists(SPOOL_DIRECTORY)) {
+    LittleFS.mkdir(SPOOL_DIRECTORY);
+  }
+
+  // Find the segments that are left from before a reboot
+  bool found = false;
+  File dir = LittleFS.open(SPOOL_DIRECTORY);
+  File entry;
+  while ((entry = dir.openNextFile())) {
+    uint32_t segment = strtoul(entry.name(), NULL, 16);
+    entry.close();
+    if (!found || segment < firstSegment) {
+      firstSegment = segment;
+    }
+    if (!found || segment >= nextSegment) {
+      nextSegment = segment + 1;
+    }
+    found = true;
+  }
+  dir.close();
+
+  if (found) {
+    LOG_INFO("SP: Found %u spooled segments", nextSegment - firstSegment);
+  }
+  removedSegment = firstSegment;
+  mounted = true;
+  return true;
+}
+
+bool MessageSpool::append(const char *message, size_t length, int32_t uid, uint8_t sender) {
+  if (!mounted || length > SPOOL_MAX_MESSAGE) {
+    return false;
+  }
+
+  unsigned long start = millis();
+  if (writeOpen && writeSize + sizeof(SpoolHeader) + length > SPOOL_SEGMENT_SIZE) {
+    closeSegment();
+  }
+
+  if (!writeOpen) {
+    // Make room by dropping the oldest segment. It is removed by collect().
+    if (nextSegment - firstSegment >= SPOOL_MAX_SEGMENTS) {
+      if (readOpen) {
+        readFile.close();
+        readOpen = false;
+        hasRecord = false;
+      }
+      firstSegment++;
+      evictedSegmentCount++;
+      LOG_ERROR("SP: Spool is full, oldest segment was dropped!");
+    }
+    if (nextSegment - removedSegment >= SPOOL_MAX_SEGMENTS) {
+      // Wait until the dropped segments were removed
+      recordStall(start);
+      return false;
+    }
+
+    char path[32];
+    segmentPath(nextSegment, path, sizeof(path));
+    writeFile = LittleFS.open(path, "w");
+    if (!writeFile) {
+      LOG_ERROR("SP: Could not create segment");
+      recordStall(start);
+      return false;
+    }
+    nextSegment++;
+    writeOpen = true;
+    writeSize = 0;
+  }
+
+  SpoolHeader header;
+  header.length = length;
+  header.sender = sender;
+  header.reserved = 0;
+  header.uid = uid;
+  writeSize += writeFile.write((const uint8_t *)&header, sizeof(header));
+  writeSize += writeFile.write((const uint8_t *)message, length);
+  recordStall(start);
+  return true;
+}
+
+void MessageSpool::flush() {
+  if (writeOpen) {
+    unsigned long start = millis();
+    writeFile.flush();
+    recordStall(start);
+  }
+}
+
+const char *MessageSpool::peek(size_t &length, int32_t &uid, uint8_t &sender) {
+  unsigned long start = millis();
+  while (!hasRecord && mounted) {
+    if (!readOpen) {
+      if (firstSegment == nextSegment) {
+        recordStall(start);
+        return NULL;
+      }
+      if (writeOpen && firstSegment == nextSegment - 1) {
+        // The segment being read must not be written any more
+        closeSegment();
+      }
+      char path[32];
+      segmentPath(firstSegment, path, sizeof(path));
+      readFile = LittleFS.open(path, "r");
+      readOpen = true;
+    }
+
+    if (readFile
+        && readFile.read((uint8_t *)&record, sizeof(record)) == sizeof(record)
+        && record.length <= SPOOL_MAX_MESSAGE
+        && readFile.read((uint8_t *)buffer, record.length) == record.length) {
+      buffer[record.length] = 0;
+      hasRecord = true;
+      break;
+    }
+
+    // Segment was completely sent (or was truncated by a power loss). It is
+    // removed by collect().
+    readFile.close();
+    readOpen = false;
+    firstSegment++;
+  }
+
+  recordStall(start);
+  if (!hasRecord) {
+    return NULL;
+  }
+  length = record.length;
+  uid = record.uid;
+  sender = record.sender;
+  return buffer;
+}
+
+void MessageSpool::release() {
+  hasRecord = false;
+}
+
+bool MessageSpool::collect() {
+  if (removedSegment == firstSegment) {
+    return false;
+  }
+
+  unsigned long start = millis();
+  char path[32];
+  segmentPath(removedSegment++, path, sizeof(path));
+  LittleFS.remove(path);
+  recordStall(start);
+  return removedSegment != firstSegment;
+}
+
+size_t MessageSpool::getSegmentCount() {
+  return nextSegment - firstSegment;
+}
+
+unsigned long MessageSpool::getEvictedSegmentCount() {
+  return evictedSegmentCount;
+}
+
+unsigned long MessageSpool::getMaxStall() {
+  return maxStall;
+}
+
+void MessageSpool::segmentPath(uint32_t segment, char *path, size_t size) {
+  snprintf(path, size, SPOOL_DIRECTORY "/%08lx", (unsigned long)segment);
+}
+
+void MessageSpool::closeSegment() {
+  writeFile.close();
+  writeOpen = false;
+}
+
+void MessageSpool::recordStall(unsigned long start) {
+  unsigned long elapsed = millis() - start;
+  if (elapsed > maxStall) {
+    maxStall = elapsed;
+  }
+}
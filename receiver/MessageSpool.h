@@ -0,0 +1,132 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MessageSpool__
+#define __MessageSpool__
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+// The spool consists of segment files of about this size. Full segments are
+// never written again, and are deleted as a whole when they were sent.
+#define SPOOL_SEGMENT_SIZE 16384
+
+// Maximum number of segments. If exceeded, the oldest segment is deleted.
+#define SPOOL_MAX_SEGMENTS 16
+
+// Maximum length of a spooled message.
+#define SPOOL_MAX_MESSAGE 1024
+
+#define SPOOL_DIRECTORY "/spool"
+
+/**
+ * Append-only log of MQTT messages in flash memory.
+ *
+ * Messages that cannot be kept in RAM while the MQTT server is unavailable
+ * are stored here, and are replayed in order after reconnection. The spool
+ * survives a reboot. Messages are delivered at least once, so a message may
+ * be sent again if the receiver was rebooted before its segment was
+ * completely sent and removed.
+ *
+ * Removing a segment erases flash, which stalls both cores. For that reason,
+ * sent and evicted segments are only removed by collect(), so the caller can
+ * decide when the stall is acceptable.
+ */
+class MessageSpool {
+public:
+  MessageSpool();
+
+  /**
+   * Mount the file system and find existing segments. Returns false if the
+   * spool cannot be used. As long as the spool is not started, it is empty
+   * and does not accept messages.
+   */
+  bool begin();
+
+  /**
+   * Append a message to the spool. Returns false if it could not be stored,
+   * e.g. because all segments are in use until collect() is invoked.
+   */
+  bool append(const char *message, size_t length, int32_t uid, uint8_t sender);
+
+  /**
+   * Make sure that all appended messages are written to flash.
+   */
+  void flush();
+
+  /**
+   * Get the oldest message, or NULL if the spool is empty. The message stays
+   * in the spool until release() is invoked.
+   */
+  const char *peek(size_t &length, int32_t &uid, uint8_t &sender);
+
+  /**
+   * Remove the message returned by peek() from the spool.
+   */
+  void release();
+
+  /**
+   * Remove one segment that was completely sent or evicted. Returns true if
+   * there are more segments to be removed.
+   */
+  bool collect();
+
+  /**
+   * Number of segments in use.
+   */
+  size_t getSegmentCount();
+
+  /**
+   * Number of segments that were dropped because the spool was full.
+   */
+  unsigned long getEvictedSegmentCount();
+
+  /**
+   * Longest time a single operation on the spool took, in ms. The CPU cores
+   * may have been stalled for that time.
+   */
+  unsigned long getMaxStall();
+
+private:
+  typedef struct spoolHeader {
+    uint16_t length;
+    uint8_t sender;
+    uint8_t reserved;
+    int32_t uid;
+  } SpoolHeader;
+
+  void segmentPath(uint32_t segment, char *path, size_t size);
+  void closeSegment();
+  void recordStall(unsigned long start);
+
+  bool mounted;
+  uint32_t removedSegment;  // oldest segment that still needs to be removed
+  uint32_t firstSegment;  // oldest segment
+  uint32_t nextSegment;   // next segment to be created
+  File writeFile;
+  bool writeOpen;
+  size_t writeSize;
+  File readFile;
+  bool readOpen;
+  bool hasRecord;
+  SpoolHeader record;
+  char buffer[SPOOL_MAX_MESSAGE + 1];
+  unsigned long evictedSegmentCount;
+  unsigned long maxStall;
+};
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "MessageWriter.h"
+
+// Position of the map size in the binary formats, it is patched by end()
+#define COUNT_OFFSET 1
+
+static const char *fieldNames[] = {
+  "uid",
+  "key",
+  "value",
+  "exp",
+  "sender",
+  "loraSignalStrength",
+  "wifiSignalStrength",
+  "systemMessage",
+  "latency",
+  "time"
+};
+
+
+MessageWriter::MessageWriter(uint8_t format, bool compactKeys) {
+  this->format = format;
+  this->compactKeys = compactKeys;
+}
+
+void MessageWriter::begin(char *buffer, size_t size) {
+  this->buffer = buffer;
+  this->size = size;
+  length = 0;
+  count = 0;
+
+  switch (format) {
+    case MESSAGE_FORMAT_CBOR:
+      write(0xB9);  // map with 16 bit size
+      writeBigEndian(0, 2);
+      break;
+
+    case MESSAGE_FORMAT_MSGPACK:
+      write(0xDE);  // map 16
+      writeBigEndian(0, 2);
+      break;
+
+    default:
+      write('{');
+  }
+}
+
+void MessageWriter::addInt(uint8_t field, int32_t value) {
+  addKey(field);
+  switch (format) {
+    case MESSAGE_FORMAT_CBOR:
+      if (value >= 0) {
+        writeCborHead(0, value);
+      } else {
+        writeCborHead(1, -1 - value);
+      }
+      break;
+
+    case MESSAGE_FORMAT_MSGPACK:
+      writeMsgpackInt(value);
+      break;
+
+    default:
+      char number[12];
+      snprintf(number, sizeof(number), "%d", value);
+      write(number);
+  }
+}
+
+void MessageWriter::addBoolean(uint8_t field, bool value) {
+  addKey(field);
+  switch (format) {
+    case MESSAGE_FORMAT_CBOR:
+      write(value ? 0xF5 : 0xF4);
+      break;
+
+    case MESSAGE_FORMAT_MSGPACK:
+      write(value ? 0xC3 : 0xC2);
+      break;
+
+    default:
+      write(value ? "true" : "false");
+  }
+}
+
+void MessageWriter::addString(uint8_t field, const char *value) {
+  addString(field, value, strlen(value));
+}
+
+void MessageWriter::addString(uint8_t field, const char *value, size_t len) {
+  addKey(field);
+  switch (format) {
+    case MESSAGE_FORMAT_CBOR:
+      writeCborHead(3, len);
+      write(value, len);
+      break;
+
+    case MESSAGE_FORMAT_MSGPACK:
+      writeMsgpackString(value, len);
+      break;
+
+    default:
+      writeJsonString(value, len);
+  }
+}
+
+size_t MessageWriter::end() {
+  if (format == MESSAGE_FORMAT_CBOR || format == MESSAGE_FORMAT_MSGPACK) {
+    // Patch the number of fields into the map header
+    if (size > COUNT_OFFSET + 1) {
+      buffer[COUNT_OFFSET] = (count >> 8) & 0xFF;
+      buffer[COUNT_OFFSET + 1] = count & 0xFF;
+    }
+  } else {
+    write('}');
+  }
+
+  if (length >= size) {
+    // Message was truncated, there is no room for the null terminator
+    return 0;
+  }
+  buffer[length] = 0;
+  return length;
+}
+
+uint8_t MessageWriter::getFormat() {
+  return format;
+}
+
+void MessageWriter::addKey(uint8_t field) {
+  switch (format) {
+    case MESSAGE_FORMAT_CBOR:
+      if (compactKeys) {
+        writeCborHead(0, field);
+      } else {
+        writeCborHead(3, strlen(fieldNames[field]));
+        write(fieldNames[field]);
+      }
+      break;
+
+    case MESSAGE_FORMAT_MSGPACK:
+      if (compactKeys) {
+        writeMsgpackInt(field);
+      } else {
+        writeMsgpackString(fieldNames[field], strlen(fieldNames[field]));
+      }
+      break;
+
+    default:
+      if (count > 0) {
+        write(',');
+      }
+      if (compactKeys) {
+        char number[6];
+        snprintf(number, sizeof(number), "\"%u\"", field);
+        write(number);
+      } else {
+        write('"');
+        write(fieldNames[field]);
+        write('"');
+      }
+      write(':');
+  }
+  count++;
+}
+
+void MessageWriter::writeJsonString(const char *str, size_t len) {
+  write('"');
+  for (const char *ptr = str; ptr < str + len; ptr++) {
+    char chr = *ptr;
+    if (chr == '"' || chr == '\\') {
+      write('\\');
+      write(chr);
+    } else if ((uint8_t)chr < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", chr);
+      write(escaped);
+    } else {
+      write(chr);
+    }
+  }
+  write('"');
+}
+
+void MessageWriter::writeCborHead(uint8_t major, uint32_t value) {
+  major <<= 5;
+  if (value < 24) {
+    write(major | value);
+  } else if (value < 0x100) {
+    write(major | 24);
+    writeBigEndian(value, 1);
+  } else if (value < 0x10000) {
+    write(major | 25);
+    writeBigEndian(value, 2);
+  } else {
+    write(major | 26);
+    writeBigEndian(value, 4);
+  }
+}
+
+void MessageWriter::writeMsgpackInt(int32_t value) {
+  if (value >= 0 && value < 128) {
+    write(value);  // positive fixint
+  } else if (value < 0 && value >= -32) {
+    write(0xE0 | (value & 0x1F));  // negative fixint
+  } else if (value >= -32768 && value < 32768) {
+    write(0xD1);  // int 16
+    writeBigEndian(value, 2);
+  } else {
+    write(0xD2);  // int 32
+    writeBigEndian(value, 4);
+  }
+}
+
+void MessageWriter::writeMsgpackString(const char *str, size_t len) {
+  if (len < 32) {
+    write(0xA0 | len);  // fixstr
+  } else if (len < 0x100) {
+    write(0xD9);  // str 8
+    writeBigEndian(len, 1);
+  } else {
+    write(0xDA);  // str 16
+    writeBigEndian(len, 2);
+  }
+  write(str, len);
+}
+
+void MessageWriter::write(char chr) {
+  // Keep counting on overflow, so end() can detect it
+  if (length < size) {
+    buffer[length] = chr;
+  }
+  length++;
+}
+
+void MessageWriter::write(const char *str) {
+  while (*str != 0) {
+    write(*str++);
+  }
+}
+
+void MessageWriter::write(const char *str, size_t len) {
+  for (size_t ix = 0; ix < len; ix++) {
+    write(str[ix]);
+  }
+}
+
+void MessageWriter::writeBigEndian(uint32_t value, size_t bytes) {
+  for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+    write((value >> shift) & 0xFF);
+  }
+}
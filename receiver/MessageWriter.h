@@ -0,0 +1,111 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MessageWriter__
+#define __MessageWriter__
+
+#include <Arduino.h>
+
+// Payload formats
+#define MESSAGE_FORMAT_JSON 0
+#define MESSAGE_FORMAT_CBOR 1
+#define MESSAGE_FORMAT_MSGPACK 2
+
+// Fields of a message. With compact keys, the number is used as key. The
+// numbers must never be changed, see README.
+#define FIELD_UID 0
+#define FIELD_KEY 1
+#define FIELD_VALUE 2
+#define FIELD_EXP 3
+#define FIELD_SENDER 4
+#define FIELD_LORA_SIGNAL_STRENGTH 5
+#define FIELD_WIFI_SIGNAL_STRENGTH 6
+#define FIELD_SYSTEM_MESSAGE 7
+#define FIELD_LATENCY 8
+#define FIELD_TIME 9
+
+/**
+ * Writes a flat map of fields directly into a buffer, without building a
+ * document in memory first. The map is either written as JSON object, or as
+ * CBOR or MessagePack map.
+ */
+class MessageWriter {
+public:
+  /**
+   * Constructor. If compactKeys is set, the field numbers are used as keys
+   * instead of the field names.
+   */
+  MessageWriter(uint8_t format = MESSAGE_FORMAT_JSON, bool compactKeys = false);
+
+  /**
+   * Start a new message in the given buffer.
+   */
+  void begin(char *buffer, size_t size);
+
+  /**
+   * Add an integer field.
+   */
+  void addInt(uint8_t field, int32_t value);
+
+  /**
+   * Add a boolean field.
+   */
+  void addBoolean(uint8_t field, bool value);
+
+  /**
+   * Add a string field. The string is escaped as required.
+   */
+  void addString(uint8_t field, const char *value);
+
+  /**
+   * Add a string field of the given length, which does not need to be null
+   * terminated.
+   */
+  void addString(uint8_t field, const char *value, size_t len);
+
+  /**
+   * Finish the message. Returns the length of the message, or 0 if the
+   * message did not fit into the buffer. A null terminator is added after
+   * the message, but is not part of the length.
+   */
+  size_t end();
+
+  /**
+   * Payload format of the messages.
+   */
+  uint8_t getFormat();
+
+private:
+  void addKey(uint8_t field);
+  void writeJsonString(const char *str, size_t len);
+  void writeCborHead(uint8_t major, uint32_t value);
+  void writeMsgpackInt(int32_t value);
+  void writeMsgpackString(const char *str, size_t len);
+  void write(char chr);
+  void write(const char *str);
+  void write(const char *str, size_t len);
+  void writeBigEndian(uint32_t value, size_t bytes);
+
+  uint8_t format;
+  bool compactKeys;
+  char *buffer;
+  size_t size;
+  size_t length;
+  uint16_t count;
+};
+
+#endif
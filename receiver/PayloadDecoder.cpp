@@ -0,0 +1,205 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "Log.h"
+#include "PayloadDecoder.h"
+
+
+static bool readKey(const Payload &payload, uint8_t &cursor, uint16_t &key) {
+  if (cursor + 2 > payload.length) {
+    return false;
+  }
+  key = (payload.data[cursor] & 0xFF) | ((payload.data[cursor + 1] & 0xFF) << 8);
+  cursor += 2;
+  return true;
+}
+
+static bool readInteger(const Payload &payload, uint8_t &cursor, size_t len, bool neg, int32_t &value) {
+  if (cursor + len > payload.length) {
+    return false;
+  }
+  value = 0;
+  for (int pos = len - 1; pos >= 0; pos--) {
+    value <<= 8;
+    value |= payload.data[cursor + pos] & 0xFF;
+  }
+  cursor += len;
+  if (neg) {
+    value = -value;
+  }
+  return true;
+}
+
+static bool readString(const Payload &payload, uint8_t &cursor, const char *&str, uint8_t &strlen) {
+  // The string is not copied, so the result is just a view into the payload
+  str = (const char *)payload.data + cursor;
+  strlen = 0;
+  while (cursor < payload.length && payload.data[cursor] != 0) {
+    strlen++;
+    cursor++;
+  }
+  if (cursor >= payload.length) {
+    return false;  // null terminator is missing
+  }
+  cursor++;
+  return true;
+}
+
+PayloadDecoder::PayloadDecoder() {
+  count = 0;
+  resyncMarker = false;
+  resyncNumber = 0;
+  resyncStartMarker = false;
+  resyncStartNumber = 0;
+}
+
+bool PayloadDecoder::decode(const Payload &payload, int rssi, float snr, unsigned long time) {
+  count = 0;
+  resyncMarker = false;
+  resyncStartMarker = false;
+
+  if (payload.length > sizeof(payload.data)) {
+    LOG_WARN("PD: Invalid payload length %u", payload.length);
+    return false;
+  }
+
+  uint8_t cursor = 0;
+  while (cursor < payload.length) {
+    uint8_t type = payload.data[cursor++];
+    LoRaEvent &event = events[count];
+    event.key = 0;
+    event.value = 0;
+    event.text = NULL;
+    event.textLength = 0;
+    event.stats = NULL;
+
+    bool valid;
+    switch (type) {
+      case 0:  // int, constant zero
+        event.type = EVENT_INT;
+        valid = readKey(payload, cursor, event.key);
+        break;
+
+      case 1:  // uint8_t positive
+      case 2:  // uint8_t negative
+        event.type = EVENT_INT;
+        valid = readKey(payload, cursor, event.key)
+                && readInteger(payload, cursor, 1, type == 2, event.value);
+        break;
+
+      case 3:  // uint16_t positive
+      case 4:  // uint16_t negative
+        event.type = EVENT_INT;
+        valid = readKey(payload, cursor, event.key)
+                && readInteger(payload, cursor, 2, type == 4, event.value);
+        break;
+
+      case 5:  // uint32_t positive
+      case 6:  // uint32_t negative
+        event.type = EVENT_INT;
+        valid = readKey(payload, cursor, event.key)
+                && readInteger(payload, cursor, 4, type == 6, event.value);
+        break;
+
+      case 7:  // boolean "false"
+      case 8:  // boolean "true"
+        event.type = EVENT_BOOLEAN;
+        event.value = type == 8;
+        valid = readKey(payload, cursor, event.key);
+        break;
+
+      case 9:  // String
+        event.type = EVENT_STRING;
+        valid = readKey(payload, cursor, event.key)
+                && readString(payload, cursor, event.text, event.textLength);
+        break;
+
+      case 253:  // Sender statistics
+        event.type = EVENT_SENDER_STATS;
+        valid = cursor + sizeof(stats) <= payload.length;
+        if (valid) {
+          memcpy(&stats, payload.data + cursor, sizeof(stats));
+          cursor += sizeof(stats);
+          event.stats = &stats;
+        }
+        break;
+
+      case 252:  // Resync start marker
+        valid = readKey(payload, cursor, resyncStartNumber);
+        resyncStartMarker = true;
+        break;
+
+      case 254:  // Resync marker
+        valid = readKey(payload, cursor, resyncNumber);
+        resyncMarker = true;
+        break;
+
+      case 255:  // System message
+        event.type = EVENT_SYSTEM_MESSAGE;
+        valid = readString(payload, cursor, event.text, event.textLength);
+        break;
+
+      default:  // Unknown type
+        valid = false;
+    }
+
+    if (!valid) {
+      LOG_WARN("PD: Rejected payload with bad entry of type %u", type);
+      count = 0;
+      resyncMarker = false;
+      resyncStartMarker = false;
+      return false;
+    }
+
+    if (type == 252 || type == 254) {
+      continue;  // the markers are not events
+    }
+
+    event.sender = payload.sender;
+    event.number = payload.number;
+    event.rssi = rssi;
+    event.snr = snr;
+    event.time = time;
+    count++;
+  }
+
+  return true;
+}
+
+const LoRaEvent *PayloadDecoder::getEvents() {
+  return events;
+}
+
+size_t PayloadDecoder::getCount() {
+  return count;
+}
+
+bool PayloadDecoder::hasResyncMarker() {
+  return resyncMarker;
+}
+
+uint16_t PayloadDecoder::getResyncNumber() {
+  return resyncNumber;
+}
+
+bool PayloadDecoder::hasResyncStartMarker() {
+  return resyncStartMarker;
+}
+
+uint16_t PayloadDecoder::getResyncStartNumber() {
+  return resyncStartNumber;
+}
@@ -0,0 +1,88 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __PayloadDecoder__
+#define __PayloadDecoder__
+
+#include <Arduino.h>
+
+#include "LoRaReceiver.h"
+
+// Maximum number of entries in a payload. The shortest entry is an empty
+// system message with 2 bytes.
+#define MAX_PAYLOAD_EVENTS (sizeof(Payload::data) / 2)
+
+/**
+ * Decodes all entries of a payload into an array of events.
+ *
+ * The payload is validated while decoding. If an entry is truncated or
+ * unknown, the payload is rejected as a whole, so a listener never sees just
+ * a part of it. The events point into the decoded payload, so it must not be
+ * changed while the events are used.
+ */
+class PayloadDecoder {
+public:
+  PayloadDecoder();
+
+  /**
+   * Decode the payload. rssi, snr and time are copied into every event.
+   * Returns false if the payload was rejected. No events are available then.
+   */
+  bool decode(const Payload &payload, int rssi, float snr, unsigned long time);
+
+  /**
+   * Events of the payload that was decoded last.
+   */
+  const LoRaEvent *getEvents();
+
+  /**
+   * Number of events of the payload that was decoded last.
+   */
+  size_t getCount();
+
+  /**
+   * Returns true if the payload contained a resync marker.
+   */
+  bool hasResyncMarker();
+
+  /**
+   * Number of the resync request that was answered by the resync marker.
+   */
+  uint16_t getResyncNumber();
+
+  /**
+   * Returns true if the payload contained a marker that the sender has
+   * started a snapshot.
+   */
+  bool hasResyncStartMarker();
+
+  /**
+   * Number of the resync request that was started by the sender.
+   */
+  uint16_t getResyncStartNumber();
+
+private:
+  LoRaEvent events[MAX_PAYLOAD_EVENTS];
+  size_t count;
+  bool resyncMarker;
+  uint16_t resyncNumber;
+  bool resyncStartMarker;
+  uint16_t resyncStartNumber;
+  SenderStats stats;  // a payload has only room for one stats entry
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __RingBuffer__
+#define __RingBuffer__
+
+#include <Arduino.h>
+#include <atomic>
+
+
+/**
+ * Lock-free ring buffer for a single producer and a single consumer, which
+ * may run on different tasks or cores. N must be a power of two.
+ *
+ * The methods neither lock nor allocate memory, so they can also be used in
+ * interrupt handlers. The reserve/commit and peek/release methods give direct
+ * access to the slots, so the items don't need to be copied.
+ */
+template <typename T, size_t N>
+class RingBuffer {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "ring buffer size must be a power of two");
+
+public:
+  RingBuffer() : head(0), tail(0), highWater(0) {}
+
+  /**
+   * Get the next free slot, or NULL if the buffer is full. The slot can be
+   * filled in place, and is added to the buffer by commit(). Calling reserve()
+   * again without commit() returns the same slot.
+   * Must only be invoked by the producer.
+   */
+  T *reserve() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= N) {
+      return NULL;
+    }
+    return &buffer[h & (N - 1)];
+  }
+
+  /**
+   * Add the slot returned by reserve() to the buffer.
+   * Must only be invoked by the producer.
+   */
+  void commit() {
+    uint32_t h = head.load(std::memory_order_relaxed) + 1;
+    head.store(h, std::memory_order_release);
+    updateHighWater(h);
+  }
+
+  /**
+   * Get the oldest item in place, or NULL if the buffer is empty. The item
+   * stays in the buffer until release() is invoked.
+   * Must only be invoked by the consumer.
+   */
+  T *peek() {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) {
+      return NULL;
+    }
+    return &buffer[t & (N - 1)];
+  }
+
+  /**
+   * Remove the item returned by peek() from the buffer.
+   * Must only be invoked by the consumer.
+   */
+  void release() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /**
+   * Add a copy of the item. Returns false if the buffer is full.
+   * Must only be invoked by the producer.
+   */
+  bool push(const T &item) {
+    T *slot = reserve();
+    if (slot == NULL) {
+      return false;
+    }
+    *slot = item;
+    commit();
+    return true;
+  }
+
+  /**
+   * Remove the oldest item and copy it to item. Returns false if the buffer is
+   * empty. Must only be invoked by the consumer.
+   */
+  bool pop(T &item) {
+    T *slot = peek();
+    if (slot == NULL) {
+      return false;
+    }
+    item = *slot;
+    release();
+    return true;
+  }
+
+  /**
+   * Number of items in the buffer.
+   */
+  size_t count() {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Maximum number of items that were in the buffer at the same time.
+   */
+  size_t getHighWater() {
+    return highWater;
+  }
+
+private:
+  void updateHighWater(uint32_t h) {
+    size_t used = h - tail.load(std::memory_order_relaxed);
+    if (used > highWater) {
+      highWater = used;
+    }
+  }
+
+  T buffer[N];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  volatile size_t highWater;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "StateStore.h"
+
+
+StateStore::StateStore() {
+  memset(entries, 0, sizeof(entries));
+}
+
+bool StateStore::isChanged(uint8_t sender, uint16_t key, uint32_t hash) {
+  StateEntry *entry = find(sender, key);
+
+  // Unknown keys, and all keys if the store is full, are always published
+  return entry == NULL || entry->id == 0 || entry->hash != hash;
+}
+
+void StateStore::store(uint8_t sender, uint16_t key, uint32_t hash) {
+  StateEntry *entry = find(sender, key);
+  if (entry != NULL) {
+    entry->id = (((uint32_t)sender << 16) | key) + 1;
+    entry->hash = hash;
+  }
+}
+
+StateStore::StateEntry *StateStore::find(uint8_t sender, uint16_t key) {
+  uint32_t id = (((uint32_t)sender << 16) | key) + 1;
+
+  // Open addressing with linear probing
+  size_t start = (key * 31 + sender) & (STATE_STORE_SIZE - 1);
+  for (size_t ix = 0; ix < STATE_STORE_SIZE; ix++) {
+    StateEntry &entry = entries[(start + ix) & (STATE_STORE_SIZE - 1)];
+    if (entry.id == id || entry.id == 0) {
+      return &entry;
+    }
+  }
+
+  // Store is full
+  return NULL;
+}
+
+uint32_t StateStore::hash(const char *value, size_t len) {
+  // FNV-1a
+  uint32_t result = 2166136261UL;
+  for (size_t ix = 0; ix < len; ix++) {
+    result ^= (uint8_t)value[ix];
+    result *= 16777619UL;
+  }
+  return result;
+}
@@ -0,0 +1,61 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __StateStore__
+#define __StateStore__
+
+#include <Arduino.h>
+
+// Maximum number of keys in the store, must be a power of two.
+#define STATE_STORE_SIZE 512
+
+/**
+ * Remembers the last published value of every key of every sender, so
+ * unchanged values are not published again.
+ */
+class StateStore {
+public:
+  StateStore();
+
+  /**
+   * Returns true if the value of a key has changed or was not known yet,
+   * false if it is unchanged. The store itself is not changed.
+   */
+  bool isChanged(uint8_t sender, uint16_t key, uint32_t hash);
+
+  /**
+   * Store the hash of the value of a key, after it was published.
+   */
+  void store(uint8_t sender, uint16_t key, uint32_t hash);
+
+  /**
+   * Hash of a string value.
+   */
+  static uint32_t hash(const char *value, size_t len);
+
+private:
+  typedef struct stateEntry {
+    uint32_t id;  // 0 if unused
+    uint32_t hash;
+  } StateEntry;
+
+  StateEntry *find(uint8_t sender, uint16_t key);
+
+  StateEntry entries[STATE_STORE_SIZE];
+};
+
+#endif
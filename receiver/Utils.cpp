@@ -20,11 +20,16 @@
  * when used in multiple modules of a project.
  */
 
+#include <sys/time.h>
+
 #include "Utils.h"
 
 #define BASE64_URL  // set base64.hpp to base64url mode
 #include <base64.hpp>
 
+// The clock is considered unset if it is before this time (2023-01-01).
+#define MIN_WALL_CLOCK 1672531200L
+
 
 void die(const char *message) {
   Serial.print("FATAL: ");
@@ -40,3 +45,22 @@ bool base64UrlDecode(const char *source, uint8_t *target, size_t targetSize) {
   decode_base64((unsigned char *)source, target);
   return true;
 }
+
+unsigned long loraAirtime(size_t length, int spreading, long bandwidth) {
+  // See SX1276 datasheet, chapter 4.1.1.7. The LoRa library uses an explicit
+  // header, coding rate 4/5, a preamble of 8 symbols, and no CRC.
+  float symbolTime = (float)(1L << spreading) * 1000.0 / bandwidth;
+  int lowDataRate = symbolTime > 16.0 ? 1 : 0;
+  int payloadSymbols = 8 + max((int)ceil((8.0 * length - 4.0 * spreading + 28) / (4.0 * (spreading - 2 * lowDataRate))) * 5, 0);
+  return (unsigned long)((8 + 4.25 + payloadSymbols) * symbolTime);
+}
+
+bool getWallClock(uint64_t &time) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (now.tv_sec < MIN_WALL_CLOCK) {
+    return false;
+  }
+  time = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+  return true;
+}
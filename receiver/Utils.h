@@ -36,4 +36,15 @@ void die(const char *message);
  */
 bool base64UrlDecode(const char *source, uint8_t *target, size_t targetSize);
 
+/**
+ * Time in ms that a LoRa package of the given length is on air.
+ */
+unsigned long loraAirtime(size_t length, int spreading, long bandwidth);
+
+/**
+ * Get the wall clock time in ms since the epoch. Returns false if the clock
+ * has not been set by NTP yet.
+ */
+bool getWallClock(uint64_t &time);
+
 #endif
@@ -21,17 +21,42 @@
 /* NOTE: The mapping.cpp file must be generated by config-converter.py, see README! */
 
 #include <Arduino.h>
-#include <ArduinoJson.h>
+
+// Kinds of integer values, as classified by config-converter.py.
+#define KIND_RAW 0       // Plain number
+#define KIND_ENUM 1      // Value is only mapped by mapIntValue()
+#define KIND_PROGRAM 2   // Value is the key of a program
+#define KIND_DURATION 3  // Value is a duration in seconds
+#define KIND_PERCENT 4   // Value is a percentage
+
+typedef struct keyMapping {
+  uint16_t key;
+  uint16_t values;  // index of the value set, NO_VALUES if there is none
+  uint32_t name;    // offset in the string pool
+  uint8_t kind;     // KIND_*, keys of other kinds may have a value set as well
+} KeyMapping;
+
+/**
+ * Find the mapping of a key, so all of its properties are looked up at once.
+ * Returns NULL if the key is unknown.
+ */
+const KeyMapping *findKey(uint16_t key);
 
 /**
  * Map a key index to the full key name, using the config.json features.
+ * Returns NULL if the key is unknown.
+ */
+const char *mapKey(uint16_t key);
+
+/**
+ * Full key name of a key mapping.
  */
-String mapKey(uint16_t key);
+const char *mapKeyName(const KeyMapping &mapping);
 
 /**
- * Map a key value to a String if possible, using the config.json feature values.
- * If there is no string defined for the value, an empty string is returned.
+ * Map a key value to a string if possible, using the config.json feature values.
+ * Returns NULL if there is no string defined for the value.
  */
-String mapIntValue(uint16_t key, int32_t value);
+const char *mapIntValue(const KeyMapping &mapping, int32_t value);
 
 #endif
\ No newline at end of file
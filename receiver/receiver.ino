@@ -15,128 +15,633 @@
  * GNU General Public License for more details.
  */
 
-#include <ArduinoJson.h>
 #include <PubSubClient.h>
 #include <WiFi.h>
 #include <WiFiClient.h>
-#include <cppQueue.h>
+#include <esp_pm.h>
+#include <time.h>
 
+#include "LatencyHistogram.h"
+#include "Log.h"
 #include "LoRaReceiver.h"
+#include "MessageQueue.h"
+#include "MessageSpool.h"
+#include "MessageWriter.h"
+#include "StateStore.h"
+#include "Utils.h"
 
 #include "config.h"
 #include "mapping.h"
 
 #define LED_PIN 25
 
-#define JSONQUEUE_SIZE 64
-#define JSONQUEUE_MESSAGE_SIZE 512
+// The MQTT task shares core 0 with the WiFi stack, the LoRa task runs on
+// core 1 with a higher priority, so it is never blocked by the MQTT server.
+#define MQTT_TASK_CORE 0
+#define LORA_TASK_CORE 1
+#define MQTT_TASK_STACK_SIZE 8192
+#define LORA_TASK_STACK_SIZE 8192
+#define MQTT_TASK_PRIORITY 1
+#define LORA_TASK_PRIORITY 3
+
+// If there is nothing to publish, the MQTT client is served at this interval
+// (ms), to keep the connection alive.
+#define MQTT_POLL_INTERVAL 100
+
+// Interval for logging the statistics
+#define STATS_INTERVAL 60000
+
+// Maximum length of an MQTT topic, and of an MQTT message. PubSubClient's
+// packet buffer is sized for both, plus the fixed header and the topic
+// length. Larger messages cannot be published, and are dropped.
+#define MQTT_MAX_TOPIC_SIZE 128
+#define MQTT_MAX_MESSAGE_SIZE 768
+#define MQTT_PACKET_OVERHEAD 7
+#define MQTT_BUFFER_SIZE (MQTT_MAX_TOPIC_SIZE + MQTT_MAX_MESSAGE_SIZE + MQTT_PACKET_OVERHEAD)
+
+// Results of sendMqttMessage()
+#define PUBLISH_OK 0
+#define PUBLISH_FAILED 1
+#define PUBLISH_TOO_LARGE 2
+
+#ifndef MQTT_PAYLOAD_FORMAT
+#define MQTT_PAYLOAD_FORMAT MESSAGE_FORMAT_JSON
+#endif
+
+#ifndef MQTT_COMPACT_KEYS
+#define MQTT_COMPACT_KEYS false
+#endif
+
+#ifndef NTP_SERVER
+#define NTP_SERVER "pool.ntp.org"
+#endif
+
+#ifndef MQTT_DRAIN_BUDGET
+#define MQTT_DRAIN_BUDGET 20
+#endif
+
+#ifdef MQTT_STATS_TOPIC
+#ifndef MQTT_STATS_INTERVAL
+#define MQTT_STATS_INTERVAL 60000
+#endif
+
+// Maximum number of sender statistics waiting to be published, must be a
+// power of two.
+#define STATS_BUFFER_SIZE 4
+
+// Maximum length of a statistics message, and of its topic.
+#define STATS_JSON_SIZE 512
+#define STATS_TOPIC_SIZE 64
+
+static_assert(STATS_TOPIC_SIZE <= MQTT_MAX_TOPIC_SIZE && STATS_JSON_SIZE <= MQTT_MAX_MESSAGE_SIZE,
+              "statistics exceed the MQTT packet buffer");
+
+typedef struct receivedStats {
+  uint8_t sender;
+  int rssi;
+  float snr;
+  SenderStats stats;
+} ReceivedStats;
+#endif
+
+#ifdef MQTT_SPOOL
+// Messages are moved to the spool if the queue is filled above this number
+// of bytes, but only for this number of ms per loop. While the flash is
+// written or erased, its cache is disabled on both cores, so the LoRa task
+// stalls as well. For that reason, the spool is only written, and sent
+// segments are only removed, while the LoRa receiver is not busy. A package
+// that is received meanwhile stays in the FIFO of the radio, and the DIO0
+// interrupt is served from IRAM.
+#define SPOOL_HIGH_WATER (MESSAGE_QUEUE_SIZE / 2)
+#define SPOOL_BUDGET 20
+#endif
+
+using ExpandFunction = void (*)(MessageWriter &writer, uint16_t key, int32_t value);
 
 unsigned long beforeMqttConnection = millis();
+bool backlogActive = false;
+unsigned long backlogStartTime;
+size_t backlogSize;
+unsigned long lastBacklogClearTime = 0;
 bool connected = false;
 WiFiClient wifiClient;
 LoRaReceiver lora(LORA_ENCRYPT_KEY);
 PubSubClient client(MQTT_SERVER_HOST, MQTT_SERVER_PORT, wifiClient);
-cppQueue jsonQueue(JSONQUEUE_MESSAGE_SIZE, JSONQUEUE_SIZE, FIFO, true);
+MessageQueue jsonQueue(MQTT_PAYLOAD_FORMAT, MQTT_COMPACT_KEYS);
+MessageWriter *writer;
+int wifiRssi = 0;
+#ifdef MQTT_TOPIC_TREE
+StateStore stateStore;
+#endif
+MessageSpool spool;
+unsigned long spooledCount = 0;
+unsigned long spooledBytes = 0;
+unsigned long spoolTime = 0;
+LatencyHistogram loraLatency;
+LatencyHistogram publishLatency;
+TaskHandle_t mqttTaskHandle = NULL;
+volatile unsigned long mqttTaskTime = 0;
+volatile unsigned long loraTaskTime = 0;
+unsigned long publishFailedCount = 0;
+unsigned long publishTooLargeCount = 0;
+#ifdef MQTT_STATS_TOPIC
+RingBuffer<ReceivedStats, STATS_BUFFER_SIZE> senderStatsQueue;
+unsigned long lastStatsTime = 0;
+#endif
 
 
-void onReceiveInt(uint16_t key, int32_t value) {
-  Serial.printf("HC: RECEIVED int %u = %d\n", key, value);
+bool hasChanged(const LoRaEvent &event, uint32_t hash) {
+#ifdef MQTT_TOPIC_TREE
+  // Only changed values are published to the key topics
+  if (!stateStore.isChanged(event.sender, event.key, hash)) {
+    LOG_DEBUG("MQ: Value of %u is unchanged", event.key);
+    return false;
+  }
+#endif
+  return true;
+}
+
+void setPublished(const LoRaEvent &event, uint32_t hash) {
+#ifdef MQTT_TOPIC_TREE
+  // Only remembered when the message was queued, so a dropped value is
+  // published again when it is repeated
+  stateStore.store(event.sender, event.key, hash);
+#endif
+}
 
-  DynamicJsonDocument doc(1024);
-  String keyStr = mapKey(key);
-  doc["uid"] = key;
-  doc["key"] = keyStr;
-  doc["value"] = value;
+bool openMessage(int32_t uid, const LoRaEvent &event) {
+  // The message is written directly into the queue
+  writer = jsonQueue.open(uid, event.sender, event.time);
+  return writer != NULL;
+}
 
-  String mapped = mapIntValue(key, value);
-  if (mapped.length() > 0) {
-    doc["exp"] = mapped;
-  } else if (keyStr == F("BSH.Common.Root.SelectedProgram")
-             || keyStr == F("BSH.Common.Root.ActiveProgram")
-             || keyStr == F("LaundryCare.Common.Option.ReferToProgram")) {
-    doc["exp"] = mapKey(value);
-  } else if (keyStr == F("BSH.Common.Option.RemainingProgramTime")
-             || keyStr == F("BSH.Common.Option.EstimatedTotalProgramTime")
-             || keyStr == F("BSH.Common.Option.FinishInRelative")) {
-    int remainHr = value / 3600;
-    int remainMin = (value / 60) % 60;
-    char buff[30];
-    snprintf(buff, sizeof(buff), "%1u:%02u", remainHr, remainMin);
-    doc["exp"] = String(buff);
-  } else if (keyStr == F("BSH.Common.Option.ProgramProgress")) {
-    char buff[30];
-    snprintf(buff, sizeof(buff), "%d%%", value);
-    doc["exp"] = String(buff);
+void writeKey(uint16_t key, const KeyMapping *mapping) {
+  writer->addInt(FIELD_UID, key);
+#ifndef MQTT_OMIT_KEY_NAME
+  if (mapping != NULL) {
+    writer->addString(FIELD_KEY, mapKeyName(*mapping));
+  } else {
+    char number[8];
+    snprintf(number, sizeof(number), "%u", key);
+    writer->addString(FIELD_KEY, number);
   }
+#endif
+}
 
-  postToMqtt(doc);
+void expandProgram(MessageWriter &writer, uint16_t key, int32_t value) {
+  const char *program = mapKey(value);
+  if (program != NULL) {
+    writer.addString(FIELD_EXP, program);
+  } else {
+    char number[12];
+    snprintf(number, sizeof(number), "%d", value);
+    writer.addString(FIELD_EXP, number);
+  }
 }
 
-void onReceiveBoolean(uint16_t key, bool value) {
-  Serial.printf("HC: RECEIVED bool %u = %d\n", key, value);
+void expandDuration(MessageWriter &writer, uint16_t key, int32_t value) {
+  int remainHr = value / 3600;
+  int remainMin = (value / 60) % 60;
+  char buff[30];
+  snprintf(buff, sizeof(buff), "%1u:%02u", remainHr, remainMin);
+  writer.addString(FIELD_EXP, buff);
+}
 
-  DynamicJsonDocument doc(1024);
-  doc["uid"] = key;
-  doc["key"] = mapKey(key);
-  doc["value"] = value;
-  postToMqtt(doc);
+void expandPercent(MessageWriter &writer, uint16_t key, int32_t value) {
+  char buff[30];
+  snprintf(buff, sizeof(buff), "%d%%", value);
+  writer.addString(FIELD_EXP, buff);
 }
 
-void onReceiveString(uint16_t key, String value) {
-  Serial.printf("HC: RECEIVED str %u = '%s'\n", key, value.c_str());
+// Expansion of integer values without a value mapping, indexed by the KIND_*
+// of the key
+const ExpandFunction expandFunctions[] = {
+  NULL,  // KIND_RAW
+  NULL,  // KIND_ENUM
+  expandProgram,
+  expandDuration,
+  expandPercent
+};
+
+void onReceiveInt(const LoRaEvent &event) {
+  LOG_DEBUG("HC: RECEIVED int %u = %d", event.key, event.value);
+
+  if (!hasChanged(event, event.value) || !openMessage(event.key, event)) {
+    return;
+  }
+  // The key is only looked up once, for its name, kind and value map
+  const KeyMapping *mapping = findKey(event.key);
+  writeKey(event.key, mapping);
+  writer->addInt(FIELD_VALUE, event.value);
+
+  if (mapping != NULL) {
+    const char *mapped = mapIntValue(*mapping, event.value);
+    uint8_t kind = mapping->kind;
+    if (mapped != NULL) {
+      writer->addString(FIELD_EXP, mapped);
+    } else if (kind < sizeof(expandFunctions) / sizeof(ExpandFunction) && expandFunctions[kind] != NULL) {
+      expandFunctions[kind](*writer, event.key, event.value);
+    }
+  }
 
-  DynamicJsonDocument doc(1024);
-  doc["uid"] = key;
-  doc["key"] = mapKey(key);
-  doc["value"] = value;
-  postToMqtt(doc);
+  if (postToMqtt(event)) {
+    setPublished(event, event.value);
+  }
 }
 
-void onReceiveSystemMessage(String value) {
-  Serial.printf("HC: RECEIVED sender message '%s'\n", value.c_str());
+void onReceiveBoolean(const LoRaEvent &event) {
+  LOG_DEBUG("HC: RECEIVED bool %u = %d", event.key, event.value);
 
-  DynamicJsonDocument doc(1024);
-  doc["systemMessage"] = value;
-  postToMqtt(doc);
+  if (!hasChanged(event, event.value) || !openMessage(event.key, event)) {
+    return;
+  }
+  writeKey(event.key, findKey(event.key));
+  writer->addBoolean(FIELD_VALUE, event.value != 0);
+  if (postToMqtt(event)) {
+    setPublished(event, event.value);
+  }
+}
+
+void onReceiveString(const LoRaEvent &event) {
+  LOG_DEBUG("HC: RECEIVED str %u = '%.*s'", event.key, event.textLength, event.text);
+
+  uint32_t hash = StateStore::hash(event.text, event.textLength);
+  if (!hasChanged(event, hash) || !openMessage(event.key, event)) {
+    return;
+  }
+  writeKey(event.key, findKey(event.key));
+  writer->addString(FIELD_VALUE, event.text, event.textLength);
+  if (postToMqtt(event)) {
+    setPublished(event, hash);
+  }
+}
+
+void onReceiveSystemMessage(const LoRaEvent &event) {
+  LOG_DEBUG("HC: RECEIVED sender message '%.*s'", event.textLength, event.text);
+
+  if (!openMessage(NO_UID, event)) {
+    return;
+  }
+  writer->addString(FIELD_SYSTEM_MESSAGE, event.text, event.textLength);
+  postToMqtt(event);
+}
+
+void onReceiveSenderStats(const LoRaEvent &event) {
+  const SenderStats &stats = *event.stats;
+  LOG_INFO("HC: RECEIVED stats of sender %u, %lu sent, %lu retried, %u dropped",
+           event.sender, (unsigned long)stats.sent, (unsigned long)stats.retried, stats.dropped);
+
+#ifdef MQTT_STATS_TOPIC
+  ReceivedStats received;
+  received.sender = event.sender;
+  received.rssi = event.rssi;
+  received.snr = event.snr;
+  received.stats = stats;
+  if (!senderStatsQueue.push(received)) {
+    LOG_ERROR("MQ: Stats queue is full, sender stats were dropped!");
+  }
+#endif
+}
+
+void onLoRaEvents(const LoRaEvent *events, size_t count) {
+  // The WLAN signal is the same for all messages of the payload
+  wifiRssi = WiFi.RSSI();
+  if (count > 0) {
+    loraLatency.record(millis() - events[0].time);
+  }
+
+  for (size_t ix = 0; ix < count; ix++) {
+    const LoRaEvent &event = events[ix];
+    switch (event.type) {
+      case EVENT_INT:
+        onReceiveInt(event);
+        break;
+
+      case EVENT_BOOLEAN:
+        onReceiveBoolean(event);
+        break;
+
+      case EVENT_STRING:
+        onReceiveString(event);
+        break;
+
+      case EVENT_SYSTEM_MESSAGE:
+        onReceiveSystemMessage(event);
+        break;
+
+      case EVENT_SENDER_STATS:
+        onReceiveSenderStats(event);
+        break;
+    }
+  }
+
+  // Wake up the MQTT task
+  if (mqttTaskHandle != NULL) {
+    xTaskNotifyGive(mqttTaskHandle);
+  }
 }
 
 void onWiFiStaIpAssigned(WiFiEvent_t event, WiFiEventInfo_t info) {
-  Serial.printf("MQ: Connected to WLAN with IP %s\n", IPAddress(info.got_ip.ip_info.ip.addr).toString());
+  LOG_INFO("MQ: Connected to WLAN with IP %s", IPAddress(info.got_ip.ip_info.ip.addr).toString().c_str());
   connected = true;
 }
 
 void onWiFiStaDisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
   connected = false;
-  Serial.println("MQ: Reconnecting to WLAN");
+  LOG_WARN("MQ: Reconnecting to WLAN");
   WiFi.begin(WLAN_SSID, WLAN_PSK);
 }
 
-void postToMqtt(DynamicJsonDocument &doc) {
-  doc["loraSignalStrength"] = lora.getRssi();
-  doc["wifiSignalStrength"] = WiFi.RSSI();
-
-  char json[JSONQUEUE_MESSAGE_SIZE];
-  if (serializeJson(doc, json, JSONQUEUE_MESSAGE_SIZE) >= JSONQUEUE_MESSAGE_SIZE - 1) {
-    Serial.println("MQ: JSON message exceeded buffer and was dropped!");
+#ifdef MQTT_EVENT_TIME
+void writeEventTime(const LoRaEvent &event) {
+  uint64_t now;
+  if (!getWallClock(now)) {
     return;
   }
-  if (!jsonQueue.push(json)) {
-    Serial.println("MQ: JSON queue is full, message was dropped!");
+
+  // The event time was estimated on our millis() clock
+  uint64_t eventTime = now - (millis() - event.time);
+  time_t seconds = eventTime / 1000;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  char timeStr[32];
+  size_t length = strftime(timeStr, sizeof(timeStr), "%Y-%m-%dT%H:%M:%S", &utc);
+  snprintf(timeStr + length, sizeof(timeStr) - length, ".%03uZ", (unsigned int)(eventTime % 1000));
+  writer->addString(FIELD_TIME, timeStr);
+}
+#endif
+
+bool postToMqtt(const LoRaEvent &event) {
+  writer->addInt(FIELD_SENDER, event.sender);
+  writer->addInt(FIELD_LORA_SIGNAL_STRENGTH, event.rssi);
+  writer->addInt(FIELD_WIFI_SIGNAL_STRENGTH, wifiRssi);
+#ifdef MQTT_LATENCY
+  writer->addInt(FIELD_LATENCY, millis() - event.time);
+#endif
+#ifdef MQTT_EVENT_TIME
+  writeEventTime(event);
+#endif
+
+  return jsonQueue.post();
+}
+
+int sendMqttMessage(const char *message, size_t length, int32_t uid, uint8_t sender) {
+  const char *topic = MQTT_TOPIC;
+  bool retain = MQTT_RETAIN;
+
+#ifdef MQTT_TOPIC_TREE
+  // Values are published to a retained topic of their key
+  char keyTopic[MQTT_MAX_TOPIC_SIZE];
+  if (uid != NO_UID) {
+    const char *keyStr = mapKey(uid);
+    if (keyStr != NULL) {
+      snprintf(keyTopic, sizeof(keyTopic), "%s/%u/%s", MQTT_TOPIC, sender, keyStr);
+    } else {
+      snprintf(keyTopic, sizeof(keyTopic), "%s/%u/%d", MQTT_TOPIC, sender, uid);
+    }
+    topic = keyTopic;
+    retain = true;
   }
+#endif
+
+  // A message that does not fit into the packet buffer would fail forever
+  if (strlen(topic) + length + MQTT_PACKET_OVERHEAD > MQTT_BUFFER_SIZE) {
+    LOG_ERROR("MQ: Message of %u bytes is too large for %s, dropped!", length, topic);
+    publishTooLargeCount++;
+    return PUBLISH_TOO_LARGE;
+  }
+
+  if (MQTT_PAYLOAD_FORMAT == MESSAGE_FORMAT_JSON) {
+    LOG_DEBUG("MQ: Sending %s to %s", message, topic);
+  } else {
+    LOG_DEBUG("MQ: Sending %u bytes to %s", length, topic);
+  }
+  if (!client.publish(topic, (const uint8_t *)message, length, retain)) {
+    LOG_ERROR("MQ: Sending failed, rc=%d", client.state());
+    publishFailedCount++;
+    return PUBLISH_FAILED;
+  }
+  return PUBLISH_OK;
 }
 
-bool sendMqttMessage(char *message) {
-  Serial.printf("MQ: Sending %s\n", message);
-  if (!client.publish(MQTT_TOPIC, message, MQTT_RETAIN)) {
-    Serial.printf("MQ: Sending failed, rc=%d\n", client.state());
+#ifdef MQTT_STATS_TOPIC
+bool sendMqttStats(const char *topic, const char *json) {
+  LOG_DEBUG("MQ: Sending %s to %s", json, topic);
+  if (!client.publish(topic, json)) {
+    LOG_ERROR("MQ: Sending stats failed, rc=%d", client.state());
+    publishFailedCount++;
     return false;
   }
   return true;
 }
 
+void publishStats() {
+  // Statistics are always JSON, regardless of MQTT_PAYLOAD_FORMAT
+  char topic[STATS_TOPIC_SIZE];
+  char json[STATS_JSON_SIZE];
+
+  ReceivedStats *received;
+  while ((received = senderStatsQueue.peek()) != NULL) {
+    const SenderStats &stats = received->stats;
+    snprintf(topic, sizeof(topic), "%s/%u", MQTT_STATS_TOPIC, received->sender);
+    snprintf(json, sizeof(json),
+             "{\"uptime\":%lu,\"sent\":%lu,\"retried\":%lu,\"dropped\":%u,\"droppedEvents\":%u,"
+             "\"badAcks\":%u,\"ackLatency\":%u,\"maxAckLatency\":%u,\"airtime\":%lu,"
+             "\"payloadQueueHighWater\":%u,\"eventQueueHighWater\":%u,"
+             "\"loraSignalStrength\":%d,\"loraSnr\":%.1f}",
+             (unsigned long)stats.uptime, (unsigned long)stats.sent, (unsigned long)stats.retried,
+             stats.dropped, stats.droppedEvents, stats.badAcks, stats.ackLatency, stats.maxAckLatency,
+             (unsigned long)stats.airtime, stats.payloadQueueHighWater, stats.eventQueueHighWater,
+             received->rssi, received->snr);
+    if (!sendMqttStats(topic, json)) {
+      return;
+    }
+    senderStatsQueue.release();
+  }
+
+  if ((millis() - lastStatsTime) < MQTT_STATS_INTERVAL) {
+    return;
+  }
+  lastStatsTime = millis();
+
+  snprintf(topic, sizeof(topic), "%s/receiver", MQTT_STATS_TOPIC);
+  snprintf(json, sizeof(json),
+           "{\"uptime\":%lu,\"received\":%lu,\"dropped\":%lu,\"rejected\":%lu,\"duplicates\":%lu,"
+           "\"downlinks\":%lu,\"downlinksDropped\":%lu,\"airtime\":%lu,\"queueHighWater\":%u,"
+           "\"latency\":%lu,\"maxLatency\":%lu,\"maxAckDelay\":%lu,"
+           "\"mqttQueueHighWater\":%u,\"mqttReplaced\":%lu,\"mqttDropped\":%lu,\"publishFailures\":%lu,"
+           "\"publishTooLarge\":%lu}",
+           millis() / 1000, lora.getReceivedCount(), lora.getDroppedCount(), lora.getRejectedCount(),
+           lora.getDuplicateCount(), lora.getDownlinkCount(), lora.getDownlinkDroppedCount(), lora.getAirtime(),
+           lora.getQueueHighWater(), lora.getAverageLatency(), lora.getMaxLatency(), lora.getMaxAckDelay(),
+           jsonQueue.getHighWater(), jsonQueue.getReplacedCount(), jsonQueue.getDroppedCount(), publishFailedCount,
+           publishTooLargeCount);
+  sendMqttStats(topic, json);
+}
+#endif
+
+void drainQueue() {
+  // A backlog is building up if there is more than one message waiting
+  if (!backlogActive && jsonQueue.count() > 1) {
+    backlogActive = true;
+    backlogStartTime = millis();
+    backlogSize = jsonQueue.count();
+  }
+
+  // Publish back to back until the queue is empty or the budget is used up
+  unsigned long start = millis();
+  size_t length;
+  int32_t uid;
+  uint8_t sender;
+  unsigned long time;
+  while (true) {
+    // Spooled messages are older, so they are sent first
+    const char *message = spool.peek(length, uid, sender);
+    bool spooled = message != NULL;
+    if (message == NULL) {
+      message = jsonQueue.peek(length, uid, sender, time);
+    }
+    if (message == NULL) {
+      break;
+    }
+    int result = sendMqttMessage(message, length, uid, sender);
+    if (result == PUBLISH_FAILED) {
+      break;
+    }
+    if (spooled) {
+      spool.release();
+    } else {
+      // Spooled messages may be from before a reboot, so they are not measured
+      if (result == PUBLISH_OK) {
+        publishLatency.record(millis() - time);
+      }
+      jsonQueue.release();
+    }
+    if ((millis() - start) >= MQTT_DRAIN_BUDGET) {
+      break;
+    }
+  }
+
+  if (backlogActive && jsonQueue.count() == 0) {
+    backlogActive = false;
+    lastBacklogClearTime = millis() - backlogStartTime;
+    LOG_INFO("MQ: Backlog of %u messages cleared in %lu ms", backlogSize, lastBacklogClearTime);
+  }
+}
+
+#ifdef MQTT_SPOOL
+void spillQueue() {
+  // Move the oldest messages to flash, until there is enough room again
+  if (lora.isBusy()) {
+    return;
+  }
+  unsigned long start = millis();
+  size_t length;
+  int32_t uid;
+  uint8_t sender;
+  unsigned long time;
+  const char *message;
+  bool spilled = false;
+  while (jsonQueue.used() > SPOOL_HIGH_WATER && (message = jsonQueue.peek(length, uid, sender, time)) != NULL) {
+    if (!spool.append(message, length, uid, sender)) {
+      break;
+    }
+    jsonQueue.release();
+    spooledCount++;
+    spooledBytes += length;
+    spilled = true;
+    if ((millis() - start) >= SPOOL_BUDGET) {
+      break;
+    }
+  }
+
+  if (spilled) {
+    spool.flush();
+    spoolTime += millis() - start;
+  }
+}
+#endif
+
+void mqttLoop() {
+  const unsigned long now = millis();
+
+  if (connected) {
+    if (!client.loop() && (now - beforeMqttConnection) > MQTT_RECONNECT_DELAY) {
+      beforeMqttConnection = now;
+      if (client.connect(MQTT_CLIENT_ID, MQTT_USER, MQTT_PASSWORD)) {
+        LOG_INFO("MQ: Connected to MQTT server");
+      } else {
+        LOG_ERROR("MQ: Failed to connect to MQTT server, rc=%d", client.state());
+      }
+    }
+  }
+
+  if (client.connected()) {
+    drainQueue();
+#ifdef MQTT_STATS_TOPIC
+    publishStats();
+#endif
+  } else {
+#ifdef MQTT_SPOOL
+    spillQueue();
+#endif
+  }
+
+#ifdef MQTT_SPOOL
+  // Remove one sent segment at a time, as erasing flash stalls the LoRa task
+  if (!lora.isBusy()) {
+    spool.collect();
+  }
+#endif
+}
+
+void mqttTask(void *parameter) {
+  while (true) {
+    unsigned long start = micros();
+    mqttLoop();
+    mqttTaskTime += micros() - start;
+
+    // Continue with the backlog after a tick, otherwise sleep until a new
+    // message is posted
+    bool pending = client.connected() && (jsonQueue.count() > 0 || spool.getSegmentCount() > 0);
+    ulTaskNotifyTake(pdTRUE, pending ? 1 : pdMS_TO_TICKS(MQTT_POLL_INTERVAL));
+  }
+}
+
+void loraTask(void *parameter) {
+  while (true) {
+    unsigned long start = micros();
+    unsigned long timeout = lora.loop();
+    loraTaskTime += micros() - start;
+
+    // Sleep until a package is received, or the next acknowledge is due.
+    // Wait at least one tick, so other tasks can run.
+    TickType_t ticks = pdMS_TO_TICKS(timeout);
+    ulTaskNotifyTake(pdTRUE, ticks > 0 ? ticks : 1);
+  }
+}
+
+void enablePowerSave() {
+#ifdef POWER_SAVE
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t pmConfig;
+  pmConfig.max_freq_mhz = 240;
+  pmConfig.min_freq_mhz = 80;
+  pmConfig.light_sleep_enable = true;
+  esp_err_t err = esp_pm_configure(&pmConfig);
+  if (err != ESP_OK) {
+    LOG_ERROR("Power saving could not be enabled, error %d", err);
+  }
+#else
+  LOG_WARN("Power management is not supported by this build, POWER_SAVE is ignored");
+#endif
+#endif
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println();
+  logBegin();
 
   // Turn LED off
   pinMode(LED_PIN, OUTPUT);
@@ -145,6 +650,8 @@ void setup() {
   // Seed random generator
   randomSeed(analogRead(0));
 
+  enablePowerSave();
+
   // Start WLAN
   WiFi.disconnect(true);
   WiFi.mode(WIFI_STA);
@@ -152,36 +659,54 @@ void setup() {
   WiFi.onEvent(onWiFiStaIpAssigned, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_GOT_IP);
   WiFi.begin(WLAN_SSID, WLAN_PSK);
 
+  // Synchronize the wall clock, as soon as WLAN is connected
+  configTime(0, 0, NTP_SERVER);
+
+  // Messages with all options exceed the default packet size of PubSubClient
+  if (!client.setBufferSize(MQTT_BUFFER_SIZE)) {
+    die("MQ: Could not allocate MQTT buffer");
+  }
+
+#ifdef MQTT_SPOOL
+  spool.begin();
+#endif
+
   // Start LoRa
-  lora.onReceiveInt(onReceiveInt);
-  lora.onReceiveBoolean(onReceiveBoolean);
-  lora.onReceiveString(onReceiveString);
-  lora.onReceiveSystemMessage(onReceiveSystemMessage);
+  lora.onReceive(onLoRaEvents);
   lora.connect();
+
+  // Start tasks
+  xTaskCreatePinnedToCore(loraTask, "lora", LORA_TASK_STACK_SIZE, NULL, LORA_TASK_PRIORITY, NULL, LORA_TASK_CORE);
+  xTaskCreatePinnedToCore(mqttTask, "mqtt", MQTT_TASK_STACK_SIZE, NULL, MQTT_TASK_PRIORITY, &mqttTaskHandle, MQTT_TASK_CORE);
 }
 
 void loop() {
-  const unsigned long now = millis();
-
-  if (connected) {
-    if (!client.loop() && (now - beforeMqttConnection) > MQTT_RECONNECT_DELAY) {
-      beforeMqttConnection = now;
-      if (client.connect(MQTT_CLIENT_ID, MQTT_USER, MQTT_PASSWORD)) {
-        Serial.println("MQ: Connected to MQTT server");
-      } else {
-        Serial.printf("MQ: Failed to connect to MQTT server, rc=%d\n", client.state());
-      }
-    }
-  }
-
-  if (client.connected()) {
-    char message[JSONQUEUE_MESSAGE_SIZE];
-    if (jsonQueue.peek(&message)) {
-      if (sendMqttMessage(message)) {
-        jsonQueue.drop();
-      }
-    }
-  }
+  // The work is done by the tasks, we only log statistics here
+  unsigned long lastMqttTime = mqttTaskTime;
+  unsigned long lastLoraTime = loraTaskTime;
+  unsigned long start = micros();
+  delay(STATS_INTERVAL);
+  unsigned long elapsed = micros() - start;
 
-  lora.loop();
+  LOG_INFO("ST: MQTT task %lu%% CPU, LoRa task %lu%% CPU",
+           (unsigned long)((uint64_t)(mqttTaskTime - lastMqttTime) * 100 / elapsed),
+           (unsigned long)((uint64_t)(loraTaskTime - lastLoraTime) * 100 / elapsed));
+  LOG_INFO("ST: LoRa %lu received, %lu dropped, %lu rejected, %lu duplicates, latency %lu us (max %lu us), ack delay max %lu ms",
+           lora.getReceivedCount(), lora.getDroppedCount(), lora.getRejectedCount(), lora.getDuplicateCount(),
+           lora.getAverageLatency(), lora.getMaxLatency(), lora.getMaxAckDelay());
+  LOG_INFO("ST: LoRa %lu downlinks, %lu dropped, queue max %u, airtime %lu ms, %lu MQTT publish failures, %lu too large",
+           lora.getDownlinkCount(), lora.getDownlinkDroppedCount(), lora.getQueueHighWater(),
+           lora.getAirtime(), publishFailedCount, publishTooLargeCount);
+  LOG_INFO("ST: Latency until received p50/p95/p99 %lu/%lu/%lu ms, until published %lu/%lu/%lu ms (%lu messages)",
+           loraLatency.percentile(50), loraLatency.percentile(95), loraLatency.percentile(99),
+           publishLatency.percentile(50), publishLatency.percentile(95), publishLatency.percentile(99),
+           publishLatency.getCount());
+  LOG_INFO("ST: JSON queue %u messages, %u of %u bytes (max %u), %lu replaced, %lu dropped, last backlog cleared in %lu ms",
+           jsonQueue.count(), jsonQueue.used(), jsonQueue.capacity(), jsonQueue.getHighWater(),
+           jsonQueue.getReplacedCount(), jsonQueue.getDroppedCount(), lastBacklogClearTime);
+#ifdef MQTT_SPOOL
+  LOG_INFO("ST: Spool %u segments, %lu dropped, %lu messages (%lu bytes) spooled in %lu ms, max stall %lu ms",
+           spool.getSegmentCount(), spool.getEvictedSegmentCount(), spooledCount, spooledBytes, spoolTime,
+           spool.getMaxStall());
+#endif
 }
@@ -22,9 +22,9 @@
 
 #include "CBC.h"  // crypto legacy, local copy
 #include "HCSocket.h"
+#include "Log.h"
 #include "Utils.h"
 
-#define SOCKET_DEBUG false
 #define SOCKET_RECONNECT_INTERVAL 5000
 
 
@@ -83,7 +83,7 @@ void HCSocket::connect(IPAddress &ip, uint16_t port) {
 
   reset();
 
-  Serial.printf("HC: Connecting to %s:%u\n", ip.toString(), port);
+  LOG_INFO("HC: Connecting to %s:%u", ip.toString().c_str(), port);
   webSocket.begin(ip, port, "/homeconnect", "");
   webSocket.onEvent(std::bind(&HCSocket::onWsEvent, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
   webSocket.setReconnectInterval(SOCKET_RECONNECT_INTERVAL);
@@ -96,11 +96,7 @@ void HCSocket::reconnect() {
 }
 
 void HCSocket::send(const JsonDocument &doc) {
-#ifdef SOCKET_DEBUG
-  Serial.println("HC: TX: Sending JSON message to appliance:");
-  serializeJson(doc, Serial);
-  Serial.println();
-#endif
+  LOG_DEBUG("HC: TX: Sending %s %s", doc["action"].as<const char *>(), doc["resource"].as<const char *>());
 
   // Convert to buffer
   size_t estimatedDocSize = measureJson(doc);
@@ -114,7 +110,7 @@ void HCSocket::send(const JsonDocument &doc) {
   }
   size_t messageLen = docLen + padLen;
   if (messageLen > sizeof(cryptBuffer) - sizeof(lastTxHmac)) {
-    Serial.printf("HC: TX: Message is too big (%u bytes), dropped!", messageLen);
+    LOG_ERROR("HC: TX: Message is too big (%u bytes), dropped!", messageLen);
     return;
   }
 
@@ -139,16 +135,16 @@ void HCSocket::send(const JsonDocument &doc) {
 
   // Send encrypted buffer
   size_t encryptedSize = messageLen + sizeof(lastTxHmac);
-  Serial.printf("HC: TX: Sending message, length %u\n", encryptedSize);
+  LOG_DEBUG("HC: TX: Sending message, length %u", encryptedSize);
   webSocket.sendBIN(cryptBuffer, encryptedSize);
 }
 
 void HCSocket::receive(uint8_t *msg, size_t size) {
-  Serial.printf("HC: RX: Received message, length %u\n", size);
+  LOG_DEBUG("HC: RX: Received message, length %u", size);
 
   // Check if the message size makes sense
   if (size < 32 || size % 16 != 0) {
-    Serial.printf("HC: RX: Incomplete message, length %u. Reconnecting!\n", size);
+    LOG_WARN("HC: RX: Incomplete message, length %u. Reconnecting!", size);
     reconnect();
     return;
   }
@@ -163,7 +159,7 @@ void HCSocket::receive(uint8_t *msg, size_t size) {
   hmacSha256.finalizeHMAC(mackey, sizeof(mackey), ourMac, sizeof(ourMac));
 
   if (0 != memcmp(msg + size - 16, ourMac, sizeof(ourMac))) {
-    Serial.println("HC: RX: HMAC mismatch. Reconnecting!");
+    LOG_ERROR("HC: RX: HMAC mismatch. Reconnecting!");
     reconnect();
     return;
   }
@@ -174,7 +170,7 @@ void HCSocket::receive(uint8_t *msg, size_t size) {
   // Decrypt message
   size_t decryptedSize = size - 16;
   if (decryptedSize > sizeof(cryptBuffer)) {
-    Serial.printf("HC: RX: Message is too big (%u bytes). Reconnecting!", decryptedSize);
+    LOG_ERROR("HC: RX: Message is too big (%u bytes). Reconnecting!", decryptedSize);
     reconnect();
     return;
   }
@@ -184,7 +180,7 @@ void HCSocket::receive(uint8_t *msg, size_t size) {
   // Remove padding
   uint8_t padLen = cryptBuffer[decryptedSize - 1];
   if (padLen > decryptedSize) {
-    Serial.println("HC: RX: Padding error. Reconnecting!");
+    LOG_ERROR("HC: RX: Padding error. Reconnecting!");
     reconnect();
     return;
   }
@@ -193,21 +189,17 @@ void HCSocket::receive(uint8_t *msg, size_t size) {
   DynamicJsonDocument doc(decryptedSize * 4);  // Better be generous
   DeserializationError error = deserializeJson(doc, (char *)&cryptBuffer, decryptedSize - padLen);
   if (error) {
-    Serial.printf("HC: RX: JSON error, message dropped: %s\n", error.f_str());
+    LOG_ERROR("HC: RX: JSON error, message dropped: %s", error.c_str());
     return;
   }
 
-#ifdef SOCKET_DEBUG
-  Serial.println("HC: RX: Received JSON message from appliance:");
-  serializeJson(doc, Serial);
-  Serial.println();
-#endif
+  LOG_DEBUG("HC: RX: Received %s %s", doc["action"].as<const char *>(), doc["resource"].as<const char *>());
 
   eventListener(doc);
 }
 
 void HCSocket::startSession(uint32_t sessionId, uint32_t txMsgId) {
-  Serial.printf("HC: Starting session, sID=%u, msgID=%u\n", sessionId, txMsgId);
+  LOG_INFO("HC: Starting session, sID=%u, msgID=%u", sessionId, txMsgId);
   this->sessionId = sessionId;
   this->txMsgId = txMsgId;
 }
@@ -248,50 +240,42 @@ void HCSocket::sendReply(const JsonDocument &query, const JsonDocument &reply) {
 void HCSocket::onWsEvent(WStype_t type, uint8_t *payload, size_t length) {
   switch (type) {
     case WStype_DISCONNECTED:
-      Serial.println(F("HC: Disconnected from appliance"));
+      LOG_INFO("HC: Disconnected from appliance");
       break;
 
     case WStype_CONNECTED:
-      Serial.println(F("HC: Connected to appliance"));
+      LOG_INFO("HC: Connected to appliance");
       reset();
       break;
 
     case WStype_TEXT:
-      Serial.printf("HC: Received unexpected text: %s\n", payload);
+      LOG_WARN("HC: Received unexpected text: %s", (const char *)payload);
       break;
 
     case WStype_BIN:
-#ifdef SOCKET_DEBUG
-      Serial.printf("HC: Received message with %u bytes\n", length);
-#endif
+      LOG_DEBUG("HC: Received message with %u bytes", length);
       receive(payload, length);
       break;
 
     case WStype_FRAGMENT_TEXT_START:
-      Serial.println(F("HC: Received unexpected text fragment"));
+      LOG_WARN("HC: Received unexpected text fragment");
       isBinFragment = false;
       break;
 
     case WStype_FRAGMENT_BIN_START:
-#ifdef SOCKET_DEBUG
-      Serial.printf("HC: Received start of fragmented message, %u bytes\n", length);
-#endif
+      LOG_DEBUG("HC: Received start of fragmented message, %u bytes", length);
       fragmentIx = 0;
       isBinFragment = true;
       appendFragment(payload, length);
       break;
 
     case WStype_FRAGMENT:
-#ifdef SOCKET_DEBUG
-      Serial.printf("HC: Received fragment, length %u bytes\n", length);
-#endif
+      LOG_DEBUG("HC: Received fragment, length %u bytes", length);
       appendFragment(payload, length);
       break;
 
     case WStype_FRAGMENT_FIN:
-#ifdef SOCKET_DEBUG
-      Serial.printf("HC: Received fragment end, length %u bytes\n", length);
-#endif
+      LOG_DEBUG("HC: Received fragment end, length %u bytes", length);
       appendFragment(payload, length);
       if (isBinFragment && fragmentIx > 0) {
         receive(fragment, fragmentIx);
@@ -301,7 +285,7 @@ void HCSocket::onWsEvent(WStype_t type, uint8_t *payload, size_t length) {
       break;
 
     case WStype_ERROR:
-      Serial.printf("HC: web socket error %u\n", length);
+      LOG_ERROR("HC: web socket error %u", length);
       break;
   }
 }
@@ -314,6 +298,6 @@ void HCSocket::appendFragment(uint8_t *payload, size_t length) {
     memcpy(fragment + fragmentIx, payload, length);
     fragmentIx += length;
   } else {
-    Serial.println(F("HC: Fragment buffer overflow, fragment part was dropped!"));
+    LOG_ERROR("HC: Fragment buffer overflow, fragment part was dropped!");
   }
 }
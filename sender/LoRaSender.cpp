@@ -16,10 +16,10 @@
  */
 
 #include <Arduino.h>
-#include <cppQueue.h>
 #include <LoRa.h>
 #include <SPI.h>
 
+#include "Log.h"
 #include "LoRaSender.h"
 #include "Utils.h"
 
@@ -39,6 +39,64 @@
 #define LORA_PACKAGE_RATE_LIMIT 1000
 #define LORA_ACK_TIMEOUT 1000
 
+// Maximum time the LoRa task sleeps if there is nothing to do, so the
+// value filter can refresh suppressed values.
+#define LORA_IDLE_WAKEUP 1000
+
+#ifdef LORA_INT_FILTERS
+static const FilterRule intFilterRules[] = LORA_INT_FILTERS;
+#define INT_FILTER_RULE_COUNT (sizeof(intFilterRules) / sizeof(FilterRule))
+#else
+static const FilterRule *intFilterRules = NULL;
+#define INT_FILTER_RULE_COUNT 0
+#endif
+
+#ifndef LORA_EVENT_TIMEOUT
+#define LORA_EVENT_TIMEOUT 100
+#endif
+
+#ifndef LORA_VALUE_CACHE_SIZE
+#define LORA_VALUE_CACHE_SIZE 128
+#endif
+
+#ifndef LORA_RESYNC_PACING
+#define LORA_RESYNC_PACING 5000
+#endif
+
+#ifndef LORA_FILTER_MAX_SILENCE
+#define LORA_FILTER_MAX_SILENCE 300000
+#endif
+
+#ifndef LORA_SENDER_ID
+#define LORA_SENDER_ID 1
+#endif
+static_assert(LORA_SENDER_ID != SENDER_BROADCAST, "LORA_SENDER_ID must not be 0");
+
+
+static volatile TaskHandle_t loopTask = NULL;
+static volatile bool dio0Raised = false;
+static volatile unsigned long dio0Time = 0;
+
+static void IRAM_ATTR onDio0Rise() {
+  // A package was received. Just wake up the LoRa task, it does the rest.
+  dio0Raised = true;
+  dio0Time = micros();
+  BaseType_t woken = pdFALSE;
+  if (loopTask != NULL) {
+    vTaskNotifyGiveFromISR(loopTask, &woken);
+  }
+  portYIELD_FROM_ISR(woken);
+}
+
+static unsigned long remaining(unsigned long since, unsigned long interval) {
+  unsigned long elapsed = millis() - since;
+  return elapsed > interval ? 0 : interval - elapsed + 1;
+}
+
+static uint16_t saturate16(unsigned long value) {
+  return value > 65535 ? 65535 : value;
+}
+
 
 LoRaSender::LoRaSender(const char *base64key) {
   SPI.begin(LORA_SCK, LORA_MISO, LORA_MOSI, LORA_CS);
@@ -46,7 +104,22 @@ LoRaSender::LoRaSender(const char *base64key) {
 
   lastSendTime = millis();
   lastPushTime = millis();
+  lastPersistTime = millis();
   nextSendDelay = 0;
+  resyncActive = false;
+  receiving = false;
+  wakeCount = 0;
+  totalWakeLatency = 0;
+  maxWakeLatency = 0;
+  sentCount = 0;
+  retryCount = 0;
+  droppedCount = 0;
+  badAckCount = 0;
+  ackCount = 0;
+  totalAckLatency = 0;
+  maxAckLatency = 0;
+  airtime = 0;
+  lastStatsTime = millis();
 
   uint8_t key[32];
   if (!base64UrlDecode(base64key, key, sizeof(key))) {
@@ -61,6 +134,12 @@ LoRaSender::LoRaSender(const char *base64key) {
   hmacSha256.update("LORAMAC", 7);
   hmacSha256.finalizeHMAC(key, sizeof(key), mackey, sizeof(mackey));
 
+  // Acknowledges use their own MAC key, so they can never be mistaken for a
+  // payload (and vice versa).
+  hmacSha256.resetHMAC(key, sizeof(key));
+  hmacSha256.update("LORAACK", 7);
+  hmacSha256.finalizeHMAC(key, sizeof(key), ackkey, sizeof(ackkey));
+
   aesEncrypt.clear();
   if (!aesEncrypt.setKey(enckey, aesEncrypt.keySize())) {
     die("LR: Invalid encryption key");
@@ -71,14 +150,24 @@ LoRaSender::LoRaSender(const char *base64key) {
   }
 
   validEncrypted = false;
-  senderQueue = new cppQueue(sizeof(Payload), PAYLOAD_BUFFER_SIZE);
-  acknowledgeQueue = new cppQueue(sizeof(Acknowledge), PAYLOAD_BUFFER_SIZE);
+  intFilter = new ValueFilter(intFilterRules, INT_FILTER_RULE_COUNT, LORA_FILTER_MAX_SILENCE);
+  valueCache = new ValueCache(LORA_VALUE_CACHE_SIZE);
+  eventQueue = new RingBuffer<SenderEvent, EVENT_BUFFER_SIZE>();
+  droppedEventCount = 0;
+  payloadBuffer = NULL;
+  currentPayload = NULL;
+  currentEventTime = millis();
+  senderQueue = new RingBuffer<QueuedPayload, PAYLOAD_BUFFER_SIZE>();
+  acknowledgeQueue = new RingBuffer<ReceivedAcknowledge, PAYLOAD_BUFFER_SIZE>();
 }
 
 LoRaSender::~LoRaSender() {
   LoRa.end();
   delete acknowledgeQueue;
   delete senderQueue;
+  delete eventQueue;
+  delete valueCache;
+  delete intFilter;
 }
 
 void LoRaSender::connect() {
@@ -90,10 +179,195 @@ void LoRaSender::connect() {
   LoRa.setSpreadingFactor(LORA_SPREADING);
   LoRa.setSignalBandwidth(LORA_BANDWIDTH);
   LoRa.setSyncWord(LORA_SYNCWORD);
+
+  // Acknowledges are received in continuous receive mode, and signalled by
+  // DIO0, so the radio does not need to be polled.
+  attachInterrupt(digitalPinToInterrupt(LORA_DIO0), onDio0Rise, RISING);
+  LoRa.receive();
+  receiving = true;
+
+#ifdef LORA_VALUE_CACHE_PERSIST
+  valueCache->load();
+#endif
 }
 
 void LoRaSender::sendInt(uint16_t key, int32_t value) {
-  Serial.printf("LR: sending int %u = %d\n", key, value);
+  SenderEvent event;
+  event.type = EVENT_INT;
+  event.key = key;
+  event.value = value;
+  postEvent(event);
+}
+
+void LoRaSender::sendBoolean(uint16_t key, bool value) {
+  SenderEvent event;
+  event.type = EVENT_BOOLEAN;
+  event.key = key;
+  event.value = value;
+  postEvent(event);
+}
+
+void LoRaSender::sendString(uint16_t key, String value) {
+  if (value.length() >= sizeof(SenderEvent::text)) {
+    LOG_ERROR("LR: String %u, size %u is too big and was dropped.", key, value.length());
+    return;
+  }
+
+  SenderEvent event;
+  event.type = EVENT_STRING;
+  event.key = key;
+  memcpy(event.text, value.c_str(), value.length() + 1);
+  postEvent(event);
+}
+
+void LoRaSender::sendSystemMessage(String message) {
+  if (message.length() >= sizeof(SenderEvent::text)) {
+    LOG_ERROR("LR: System Message '%s' is too big and was dropped.", message.c_str());
+    return;
+  }
+
+  SenderEvent event;
+  event.type = EVENT_SYSTEM_MESSAGE;
+  memcpy(event.text, message.c_str(), message.length() + 1);
+  postEvent(event);
+}
+
+void LoRaSender::flush() {
+  SenderEvent event;
+  event.type = EVENT_FLUSH;
+  postEvent(event);
+}
+
+void LoRaSender::sleep() {
+  SenderEvent event;
+  event.type = EVENT_SLEEP;
+  postEvent(event);
+}
+
+size_t LoRaSender::getEventQueueDepth() {
+  return eventQueue->count();
+}
+
+size_t LoRaSender::getEventQueueHighWater() {
+  return eventQueue->getHighWater();
+}
+
+unsigned long LoRaSender::getDroppedEventCount() {
+  return droppedEventCount;
+}
+
+unsigned long LoRaSender::getAverageWakeLatency() {
+  return wakeCount > 0 ? (unsigned long)(totalWakeLatency / wakeCount) : 0;
+}
+
+unsigned long LoRaSender::getMaxWakeLatency() {
+  return maxWakeLatency;
+}
+
+unsigned long LoRaSender::getSentCount() {
+  return sentCount;
+}
+
+unsigned long LoRaSender::getRetryCount() {
+  return retryCount;
+}
+
+unsigned long LoRaSender::getDroppedCount() {
+  return droppedCount;
+}
+
+unsigned long LoRaSender::getBadAckCount() {
+  return badAckCount;
+}
+
+unsigned long LoRaSender::getAverageAckLatency() {
+  return ackCount > 0 ? (unsigned long)(totalAckLatency / ackCount) : 0;
+}
+
+unsigned long LoRaSender::getMaxAckLatency() {
+  return maxAckLatency;
+}
+
+size_t LoRaSender::getPayloadQueueHighWater() {
+  return senderQueue->getHighWater();
+}
+
+unsigned long LoRaSender::getAirtime() {
+  return airtime;
+}
+
+unsigned long LoRaSender::getSuppressedCount() {
+  return intFilter->getSuppressedCount();
+}
+
+unsigned long LoRaSender::getRefreshedCount() {
+  return intFilter->getRefreshedCount();
+}
+
+void LoRaSender::postEvent(SenderEvent &event) {
+  event.time = millis();
+
+  // If the LoRa task cannot keep up, wait a moment before dropping the event
+  unsigned long start = millis();
+  while (!eventQueue->push(event)) {
+    if ((millis() - start) > LORA_EVENT_TIMEOUT) {
+      droppedEventCount++;
+      LOG_ERROR("LR: Event queue is full, event was dropped!");
+      return;
+    }
+    vTaskDelay(1);
+  }
+
+  // Wake up the LoRa task
+  if (loopTask != NULL) {
+    xTaskNotifyGive(loopTask);
+  }
+}
+
+void LoRaSender::handleEvent(SenderEvent &event) {
+  currentEventTime = event.time;
+  switch (event.type) {
+    case EVENT_INT:
+      handleInt(event.key, event.value);
+      break;
+
+    case EVENT_BOOLEAN:
+      handleBoolean(event.key, event.value != 0);
+      break;
+
+    case EVENT_STRING:
+      handleString(event.key, event.text);
+      break;
+
+    case EVENT_SYSTEM_MESSAGE:
+      handleSystemMessage(event.text);
+      break;
+
+    case EVENT_FLUSH:
+      flushPayload();
+      break;
+
+    case EVENT_SLEEP:
+      handleSleep();
+      break;
+  }
+}
+
+void LoRaSender::handleInt(uint16_t key, int32_t value) {
+  if (valueCache->isAcknowledged(key, VALUE_TYPE_INT, value)) {
+    LOG_DEBUG("LR: int %u = %d is unchanged", key, value);
+    return;
+  }
+  if (!intFilter->accept(key, value)) {
+    LOG_DEBUG("LR: int %u = %d suppressed by filter (%lu so far)", key, value, intFilter->getSuppressedCount());
+    return;
+  }
+  valueCache->queue(key, VALUE_TYPE_INT, value);
+  encodeInt(key, value);
+}
+
+void LoRaSender::encodeInt(uint16_t key, int32_t value) {
+  LOG_DEBUG("LR: sending int %u = %d", key, value);
 
   if (value == 0) {
     sendMessage(0, key, NULL, 0);
@@ -131,163 +405,305 @@ void LoRaSender::sendInt(uint16_t key, int32_t value) {
   sendMessage(negative ? 6 : 5, key, data, sizeof(data));
 }
 
-void LoRaSender::sendBoolean(uint16_t key, bool value) {
-  Serial.printf("LR: sending bool %u = %d\n", key, value);
+void LoRaSender::handleBoolean(uint16_t key, bool value) {
+  if (valueCache->isAcknowledged(key, VALUE_TYPE_BOOLEAN, value)) {
+    LOG_DEBUG("LR: bool %u = %d is unchanged", key, value);
+    return;
+  }
+
+  LOG_DEBUG("LR: sending bool %u = %d", key, value);
+  valueCache->queue(key, VALUE_TYPE_BOOLEAN, value);
   sendMessage(value ? 8 : 7, key, NULL, 0);
 }
 
-void LoRaSender::sendString(uint16_t key, String value) {
-  Serial.printf("LR: sending string %u = '%s'\n", key, value.c_str());
-  sendMessage(9, key, (uint8_t *)value.c_str(), value.length() + 1);
+void LoRaSender::handleString(uint16_t key, const char *value) {
+  int32_t hash = ValueCache::hash(value);
+  if (valueCache->isAcknowledged(key, VALUE_TYPE_STRING, hash)) {
+    LOG_DEBUG("LR: string %u = '%s' is unchanged", key, value);
+    return;
+  }
+
+  LOG_DEBUG("LR: sending string %u = '%s'", key, value);
+  valueCache->queue(key, VALUE_TYPE_STRING, hash, value);
+  sendMessage(9, key, (uint8_t *)value, strlen(value) + 1);
 }
 
-void LoRaSender::sendSystemMessage(String message) {
-  Serial.printf("LR: sending system msg '%s'\n", message.c_str());
+void LoRaSender::handleSystemMessage(const char *message) {
+  LOG_DEBUG("LR: sending system msg '%s'", message);
 
-  size_t length = message.length() + 1;
-  if (payloadBuffer.length + 1 + length > sizeof(payloadBuffer.data)) {
-    flush();
+  size_t length = strlen(message) + 1;
+  if (bufferedLength() + 1 + length > sizeof(Payload::data)) {
+    flushPayload();
   }
-  if (payloadBuffer.length + 1 + length > sizeof(payloadBuffer.data)) {
-    Serial.printf("LR: System Message '%s' is too big and was dropped.\n", message);
+  if (bufferedLength() + 1 + length > sizeof(Payload::data)) {
+    LOG_ERROR("LR: System Message '%s' is too big and was dropped.", message);
     return;
   }
 
-  payloadBuffer.data[payloadBuffer.length++] = 255;
-  memcpy(payloadBuffer.data + payloadBuffer.length, message.c_str(), length);
-  payloadBuffer.length += length;
+  Payload *payload = openPayload();
+  if (payload == NULL) {
+    return;
+  }
+
+  payload->data[payload->length++] = 255;
+  memcpy(payload->data + payload->length, message, length);
+  payload->length += length;
 
   // System messages are sent immediately
-  flush();
+  flushPayload();
 }
 
 void LoRaSender::sendMessage(uint8_t type, uint16_t key, uint8_t *msg, size_t length) {
-  if (payloadBuffer.length + 3 + length > sizeof(payloadBuffer.data)) {
-    flush();
+  if (bufferedLength() + 3 + length > sizeof(Payload::data)) {
+    flushPayload();
+  }
+  if (bufferedLength() + 3 + length > sizeof(Payload::data)) {
+    LOG_ERROR("LR: Message type %u, key %u, size %u is too big and was dropped.", type, key, length);
+    return;
   }
-  if (payloadBuffer.length + 3 + length > sizeof(payloadBuffer.data)) {
-    Serial.printf("LR: Message type %u, key %u, size %u is too big and was dropped.\n", type, key, length);
+
+  Payload *payload = openPayload();
+  if (payload == NULL) {
     return;
   }
 
-  payloadBuffer.data[payloadBuffer.length++] = type;
-  payloadBuffer.data[payloadBuffer.length++] = key & 0xFF;
-  payloadBuffer.data[payloadBuffer.length++] = (key >> 8) & 0xFF;
+  payload->data[payload->length++] = type;
+  payload->data[payload->length++] = key & 0xFF;
+  payload->data[payload->length++] = (key >> 8) & 0xFF;
   if (length > 0) {
-    memcpy(payloadBuffer.data + payloadBuffer.length, msg, length);
-    payloadBuffer.length += length;
+    memcpy(payload->data + payload->length, msg, length);
+    payload->length += length;
   }
 
   lastPushTime = millis();
 }
 
-void LoRaSender::flush() {
-  if (payloadBuffer.length != 0) {
-    sendRaw(payloadBuffer);
-    payloadBuffer.number++;
-    payloadBuffer.length = 0;
-    lastPushTime = millis();
+Payload *LoRaSender::openPayload() {
+  // The payload is built directly in the next free slot of the queue
+  if (payloadBuffer == NULL) {
+    payloadBuffer = senderQueue->reserve();
+    if (payloadBuffer == NULL) {
+      LOG_ERROR("LR: Queue is full, message was dropped!");
+      droppedCount++;
+      return NULL;
+    }
+    payloadBuffer->payload.length = 0;
+    payloadBuffer->time = currentEventTime;
   }
+  return &payloadBuffer->payload;
 }
 
-void LoRaSender::sleep() {
-  Serial.println("LR: Put LoRa to sleep");
-  LoRa.idle();
+size_t LoRaSender::bufferedLength() {
+  return payloadBuffer != NULL ? payloadBuffer->payload.length : 0;
 }
 
-void LoRaSender::sendRaw(Payload &payload) {
-  if (!senderQueue->push(&payload)) {
-    Serial.println("LR: Queue is full, payload was dropped!");
+void LoRaSender::flushPayload() {
+  if (bufferedLength() != 0) {
+    senderQueue->commit();
+    payloadBuffer = NULL;
+    lastPushTime = millis();
   }
 }
 
+void LoRaSender::handleSleep() {
+  LOG_INFO("LR: Put LoRa to sleep");
+  LoRa.idle();
+  receiving = false;
+}
+
 void LoRaSender::onLoRaReceive(int packetSize) {
   if (packetSize != sizeof(Acknowledge)) {
-    Serial.printf("LRC: Ignoring message with length %u\n", packetSize);
+    LOG_WARN("LRC: Ignoring message with length %u", packetSize);
     return;
   }
 
-  uint8_t cryptBuffer[sizeof(Acknowledge)];
+  ReceivedAcknowledge *received = acknowledgeQueue->reserve();
+  if (received == NULL) {
+    LOG_ERROR("LRC: Queue is full, message was dropped!");
+    return;
+  }
+  received->receivedAt = millis() - (micros() - dio0Time) / 1000;
 
   size_t receiveLength = 0;
   uint8_t chr;
   while (LoRa.available()) {
     chr = (uint8_t)LoRa.read();
-    if (receiveLength < sizeof(cryptBuffer)) {
-      cryptBuffer[receiveLength++] = chr;
+    if (receiveLength < sizeof(Acknowledge)) {
+      received->package[receiveLength++] = chr;
     }
   }
 
-  if (acknowledgeQueue->push(&cryptBuffer)) {
-    Serial.println("LRC: Received acknowledge message");
-  } else {
-    Serial.println("LRC: Queue is full, message was dropped!");
-  }
+  acknowledgeQueue->commit();
+  LOG_DEBUG("LRC: Received acknowledge message");
 }
 
-void LoRaSender::loop() {
-  int packetSize = LoRa.parsePacket();
-  if (packetSize) {
-    onLoRaReceive(packetSize);
+unsigned long LoRaSender::loop() {
+  loopTask = xTaskGetCurrentTaskHandle();
+
+  if (dio0Raised) {
+    dio0Raised = false;
+    int packetSize = LoRa.parsePacket();
+    if (packetSize) {
+      unsigned long latency = micros() - dio0Time;
+      wakeCount++;
+      totalWakeLatency += latency;
+      if (latency > maxWakeLatency) {
+        maxWakeLatency = latency;
+      }
+      onLoRaReceive(packetSize);
+    }
+    if (receiving) {
+      LoRa.receive();
+    }
+  }
+
+  // Take new events, as long as there is room for the resulting payloads
+  SenderEvent event;
+  while (senderQueue->count() + 2 <= PAYLOAD_BUFFER_SIZE && eventQueue->pop(event)) {
+    handleEvent(event);
   }
 
-  if (validEncrypted) {
-    // Check if we got an acknowledge already?
-    uint8_t ackPackage[sizeof(Acknowledge)];
-    if (acknowledgeQueue->pop(ackPackage)) {
-      if (checkAcknowledge(ackPackage)) {
+  uint16_t refreshKey;
+  int32_t refreshValue;
+  currentEventTime = millis();
+  while (intFilter->poll(refreshKey, refreshValue)) {
+    LOG_DEBUG("LR: Refreshing suppressed int %u after maximum silence", refreshKey);
+    valueCache->queue(refreshKey, VALUE_TYPE_INT, refreshValue);
+    encodeInt(refreshKey, refreshValue);
+  }
+
+  // Check if we got an acknowledge or a request
+  ReceivedAcknowledge *ackPackage = acknowledgeQueue->peek();
+  if (ackPackage != NULL) {
+    Acknowledge acknowledge;
+    bool valid = decryptAcknowledge(ackPackage->package, acknowledge);
+    unsigned long receivedAt = ackPackage->receivedAt;
+    acknowledgeQueue->release();
+    if (valid) {
+      if (acknowledge.sender != LORA_SENDER_ID && acknowledge.sender != SENDER_BROADCAST) {
+        // Addressed to another sender
+      } else if (acknowledge.type == ACK_TYPE_RESYNC) {
+        startResync(acknowledge.number);
+      } else if (validEncrypted && acknowledge.number == currentPayloadNumber) {
+        unsigned long latency = receivedAt - lastSendTime;
+        ackCount++;
+        totalAckLatency += latency;
+        if (latency > maxAckLatency) {
+          maxAckLatency = latency;
+        }
         validEncrypted = false;
+        acknowledgePayload(currentPayload->payload);
+        senderQueue->release();
+      } else {
+        LOG_WARN("LR: Unexpected package number, ignoring");
       }
     }
   }
-  yield();
+
+  if (resyncActive) {
+    continueResync();
+  }
+
+#ifdef LORA_VALUE_CACHE_PERSIST
+  if ((millis() - lastPersistTime) > LORA_VALUE_CACHE_PERSIST) {
+    valueCache->save();
+    lastPersistTime = millis();
+  }
+#endif
+
+#ifdef LORA_STATS_INTERVAL
+  if ((millis() - lastStatsTime) > LORA_STATS_INTERVAL) {
+    sendStats();
+    lastStatsTime = millis();
+  }
+#endif
 
 #ifdef LORA_COLLECT_TIME
-  if (!validEncrypted && payloadBuffer.length != 0 && (millis() - lastPushTime) > LORA_COLLECT_TIME) {
-    flush();
+  if (!validEncrypted && bufferedLength() != 0 && (millis() - lastPushTime) > LORA_COLLECT_TIME) {
+    flushPayload();
   }
-  yield();
 #endif
 
   if (validEncrypted) {
     if ((millis() - lastSendTime) > nextSendDelay) {
       attempts++;
       if (attempts <= LORA_MAX_SENDING_ATTEMPTS) {
-        Serial.printf("LR: Transmitting %u bytes (attempt %u/%u)\n", currentEncryptedLength, attempts, LORA_MAX_SENDING_ATTEMPTS);
+        encryptPayload(*currentPayload);
+        LOG_DEBUG("LR: Transmitting %u bytes (attempt %u/%u)", currentEncryptedLength, attempts, LORA_MAX_SENDING_ATTEMPTS);
         transmitPayload();
         lastSendTime = millis();
+        sentCount++;
+        if (attempts > 1) {
+          retryCount++;
+        }
         nextSendDelay = LORA_PACKAGE_RATE_LIMIT + random(100);
       } else {
-        Serial.println("LR: Maximum number of reattempts reached, package dropped!");
+        LOG_ERROR("LR: Maximum number of reattempts reached, package dropped!");
+        droppedCount++;
         validEncrypted = false;
+        senderQueue->release();
       }
     }
   }
-  yield();
 
   if (!validEncrypted) {
-    // No message there, take and encrypt one
-    Payload sendPayload;
-    if (senderQueue->pop(&sendPayload)) {
-      encryptPayload(sendPayload);
+    // No message there, take one. It stays in the queue until it was
+    // acknowledged or dropped. The message number is kept for all attempts,
+    // so the receiver detects duplicates.
+    currentPayload = senderQueue->peek();
+    if (currentPayload != NULL) {
+      currentPayload->payload.number = random(65536);
+      currentPayloadNumber = currentPayload->payload.number;
       attempts = 0;
       validEncrypted = true;
     }
   }
-  yield();
+
+  return nextWakeup();
+}
+
+unsigned long LoRaSender::nextWakeup() {
+  if (acknowledgeQueue->count() > 0) {
+    return 0;  // more acknowledges are waiting
+  }
+
+  unsigned long wakeup = LORA_IDLE_WAKEUP;
+  if (validEncrypted) {
+    wakeup = min(wakeup, remaining(lastSendTime, nextSendDelay));
+  }
+  if (resyncActive) {
+    wakeup = min(wakeup, remaining(lastResyncTime, LORA_RESYNC_PACING));
+  }
+#ifdef LORA_VALUE_CACHE_PERSIST
+  wakeup = min(wakeup, remaining(lastPersistTime, LORA_VALUE_CACHE_PERSIST));
+#endif
+#ifdef LORA_STATS_INTERVAL
+  wakeup = min(wakeup, remaining(lastStatsTime, LORA_STATS_INTERVAL));
+#endif
+#ifdef LORA_COLLECT_TIME
+  if (!validEncrypted && bufferedLength() != 0) {
+    wakeup = min(wakeup, remaining(lastPushTime, LORA_COLLECT_TIME));
+  }
+#endif
+  return wakeup;
 }
 
-void LoRaSender::encryptPayload(Payload &sendPayload) {
+void LoRaSender::encryptPayload(QueuedPayload &queued) {
+  Payload &sendPayload = queued.payload;
+
   // Reduce package to minimum required length
   size_t grossPayloadLength = sendPayload.length
                               + sizeof(sendPayload.hash)
                               + sizeof(sendPayload.number)
-                              + sizeof(sendPayload.length);
+                              + sizeof(sendPayload.sender)
+                              + sizeof(sendPayload.length)
+                              + sizeof(sendPayload.age);
   currentEncryptedLength = (grossPayloadLength + 15) / 16 * 16;
 
-  // Give package a random message number
-  sendPayload.number = random(65536);
-  currentPayloadNumber = sendPayload.number;
+  // The age is stamped on every attempt, so the package is encrypted again
+  unsigned long age = millis() - queued.time;
+  sendPayload.sender = LORA_SENDER_ID;
+  sendPayload.age = age > 65535 ? 65535 : age;
 
   // Fill unused payload part with random numbers
   for (int ix = sendPayload.length; ix < sizeof(sendPayload.data); ix++) {
@@ -314,30 +730,172 @@ void LoRaSender::transmitPayload() {
     LoRa.beginPacket();
     LoRa.write(currentEncrypted, currentEncryptedLength);
     LoRa.endPacket();
-    yield();
+    airtime += loraAirtime(currentEncryptedLength, LORA_SPREADING, LORA_BANDWIDTH);
+
+    // Wait for the acknowledge
+    LoRa.receive();
+    receiving = true;
   }
 }
 
-bool LoRaSender::checkAcknowledge(uint8_t *ackPackage) {
+bool LoRaSender::decryptAcknowledge(uint8_t *ackPackage, Acknowledge &unencrypted) {
   // Decrypt acknowledge message
-  Acknowledge unencrypted;
   aesDecrypt.decryptBlock((uint8_t *)&unencrypted, ackPackage);
 
   // Check the hash
   uint8_t ourHash[sizeof(unencrypted.hash)];
-  hmacSha256.resetHMAC(mackey, sizeof(mackey));
+  hmacSha256.resetHMAC(ackkey, sizeof(ackkey));
   hmacSha256.update(((uint8_t *)&unencrypted) + sizeof(unencrypted.hash), sizeof(unencrypted) - sizeof(unencrypted.hash));
-  hmacSha256.finalizeHMAC(mackey, sizeof(mackey), ourHash, sizeof(ourHash));
+  hmacSha256.finalizeHMAC(ackkey, sizeof(ackkey), ourHash, sizeof(ourHash));
 
   if (0 != memcmp(unencrypted.hash, ourHash, sizeof(ourHash))) {
-    Serial.println("LR: Bad acknowledge HMAC, ignoring");
+    LOG_ERROR("LR: Bad acknowledge HMAC, ignoring");
+    badAckCount++;
     return false;
   }
 
-  if (unencrypted.number != currentPayloadNumber) {
-    Serial.println("LR: Unexpected package number, ignoring");
-    return false;
+  return true;
+}
+
+void LoRaSender::startResync(uint16_t number) {
+  if (resyncActive && resyncNumber == number) {
+    // Repeated request, tell the receiver that we are already working on it
+    sendMessage(252, resyncNumber, NULL, 0);
+    return;
   }
 
-  return true;
+  LOG_INFO("LR: Receiver requested a resync of %u values", valueCache->size());
+  resyncActive = true;
+  resyncNumber = number;
+  resyncCursor = 0;
+  lastResyncTime = millis() - LORA_RESYNC_PACING;
+
+  // Tell the receiver that the snapshot has started, with the first package
+  sendMessage(252, resyncNumber, NULL, 0);
+}
+
+void LoRaSender::continueResync() {
+  // Only send a snapshot package if there is nothing else to do, so the
+  // snapshot does not delay current events.
+  if (validEncrypted || senderQueue->count() > 0 || (millis() - lastResyncTime) < LORA_RESYNC_PACING) {
+    return;
+  }
+
+  currentEventTime = millis();
+  while (resyncCursor < valueCache->size() && senderQueue->count() == 0) {
+    uint16_t key;
+    uint8_t type;
+    int32_t value;
+    const char *text;
+    valueCache->get(resyncCursor++, key, type, value, text);
+    switch (type) {
+      case VALUE_TYPE_INT:
+        encodeInt(key, value);
+        break;
+
+      case VALUE_TYPE_BOOLEAN:
+        sendMessage(value ? 8 : 7, key, NULL, 0);
+        break;
+
+      case VALUE_TYPE_STRING:
+        if (text != NULL) {
+          sendMessage(9, key, (uint8_t *)text, strlen(text) + 1);
+        }
+        break;
+    }
+  }
+
+  if (resyncCursor >= valueCache->size() && senderQueue->count() == 0) {
+    // Snapshot is complete, send marker with the request number
+    sendMessage(254, resyncNumber, NULL, 0);
+    flushPayload();
+    resyncActive = false;
+    LOG_INFO("LR: Resync completed");
+  }
+
+  lastResyncTime = millis();
+}
+
+void LoRaSender::acknowledgePayload(Payload &payload) {
+  // Remember all values of the payload as acknowledged by the receiver
+  uint8_t cursor = 0;
+  while (cursor < payload.length) {
+    uint8_t type = payload.data[cursor++];
+    if (type == 255) {
+      // System message, skip the string
+      cursor += strnlen((const char *)payload.data + cursor, payload.length - cursor) + 1;
+      continue;
+    }
+    if (type == 253) {
+      // Statistics, no values
+      cursor += sizeof(SenderStats);
+      continue;
+    }
+
+    if (cursor + 2 > payload.length) {
+      return;
+    }
+    uint16_t key = payload.data[cursor] | (payload.data[cursor + 1] << 8);
+    cursor += 2;
+
+    if (type <= 6) {
+      size_t len = type == 0 ? 0 : 1 << ((type - 1) / 2);
+      if (cursor + len > payload.length) {
+        return;
+      }
+      int32_t value = 0;
+      for (int pos = len - 1; pos >= 0; pos--) {
+        value = (value << 8) | payload.data[cursor + pos];
+      }
+      cursor += len;
+      valueCache->acknowledge(key, VALUE_TYPE_INT, (type % 2 == 0 && type != 0) ? -value : value);
+    } else if (type == 252 || type == 254) {
+      // Resync markers, no values
+    } else if (type == 7 || type == 8) {
+      valueCache->acknowledge(key, VALUE_TYPE_BOOLEAN, type == 8);
+    } else if (type == 9) {
+      const char *str = (const char *)payload.data + cursor;
+      size_t len = strnlen(str, payload.length - cursor);
+      if (cursor + len >= payload.length) {
+        return;
+      }
+      valueCache->acknowledge(key, VALUE_TYPE_STRING, ValueCache::hash(str));
+      cursor += len + 1;
+    } else {
+      return;
+    }
+  }
+}
+
+void LoRaSender::sendStats() {
+  SenderStats stats;
+  stats.uptime = millis() / 1000;
+  stats.sent = sentCount;
+  stats.retried = retryCount;
+  stats.airtime = airtime;
+  stats.dropped = saturate16(droppedCount);
+  stats.droppedEvents = saturate16(droppedEventCount);
+  stats.badAcks = saturate16(badAckCount);
+  stats.ackLatency = saturate16(getAverageAckLatency());
+  stats.maxAckLatency = saturate16(maxAckLatency);
+  stats.payloadQueueHighWater = senderQueue->getHighWater();
+  stats.eventQueueHighWater = min(eventQueue->getHighWater(), (size_t)255);
+
+  LOG_INFO("LR: sending stats, %lu sent, %lu retried, %lu dropped", sentCount, retryCount, droppedCount);
+
+  currentEventTime = millis();
+  if (bufferedLength() + 1 + sizeof(stats) > sizeof(Payload::data)) {
+    flushPayload();
+  }
+  Payload *payload = openPayload();
+  if (payload == NULL) {
+    return;
+  }
+
+  payload->data[payload->length++] = 253;
+  memcpy(payload->data + payload->length, &stats, sizeof(stats));
+  payload->length += sizeof(stats);
+
+  // Statistics are sent immediately, so the receiver gets them in time
+  flushPayload();
 }
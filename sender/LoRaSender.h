@@ -21,9 +21,12 @@
 #include <AES.h>
 #include <Arduino.h>
 #include <assert.h>
-#include <cppQueue.h>
 #include <SHA256.h>
 
+#include "RingBuffer.h"
+#include "ValueCache.h"
+#include "ValueFilter.h"
+
 
 // Must be a multiple of 16. In the European Union, the maximum permitted LoRa
 // payload size over all data rates is 51 bytes, so the next smaller payload
@@ -37,24 +40,86 @@
 // Maximum number of payloads to keep in the buffer.
 #define PAYLOAD_BUFFER_SIZE 32
 
+// Maximum number of events waiting to be encoded, must be a power of two.
+#define EVENT_BUFFER_SIZE 64
+
 
 typedef struct payload {
   uint8_t hash[4];  // MUST be the first element!
   uint16_t number;
+  uint8_t sender;
   uint8_t length;
-  uint8_t data[MAX_PAYLOAD_SIZE - sizeof(hash) - sizeof(number) - sizeof(length)];
+  uint16_t age;  // ms since the oldest entry was created, at transmission
+  uint8_t data[MAX_PAYLOAD_SIZE - sizeof(hash) - sizeof(number) - sizeof(sender) - sizeof(length) - sizeof(age)];
 } Payload;
 static_assert(sizeof(struct payload) == MAX_PAYLOAD_SIZE, "payload structure does not have expected size");
 
+typedef struct queuedPayload {
+  Payload payload;
+  unsigned long time;  // millis() when the oldest entry was created
+} QueuedPayload;
+
+// Types of the packages that are sent by the receiver.
+#define ACK_TYPE_ACKNOWLEDGE 0
+#define ACK_TYPE_RESYNC 1
+
+// Sender ID for addressing all senders.
+#define SENDER_BROADCAST 0
+
 typedef struct acknowledge {
   uint8_t hash[4];  // MUST be the first element!
   uint16_t number;
-  uint8_t pad[MAX_ACK_SIZE - sizeof(hash) - sizeof(number)];
+  uint8_t sender;
+  uint8_t type;
+  uint8_t pad[MAX_ACK_SIZE - sizeof(hash) - sizeof(number) - sizeof(sender) - sizeof(type)];
 } Acknowledge;
 static_assert(sizeof(struct acknowledge) == MAX_ACK_SIZE, "acknowledge structure does not have expected size");
 
+typedef struct receivedAcknowledge {
+  uint8_t package[sizeof(Acknowledge)];  // still encrypted
+  unsigned long receivedAt;              // millis() when the radio raised DIO0
+} ReceivedAcknowledge;
+
+// Link statistics of a sender. They are sent as payload entry of type 253,
+// followed by this structure.
+typedef struct senderStats {
+  uint32_t uptime;   // s
+  uint32_t sent;     // transmissions, including retries
+  uint32_t retried;
+  uint32_t airtime;  // ms
+  uint16_t dropped;  // payloads that were never acknowledged, or did not fit into the queue
+  uint16_t droppedEvents;
+  uint16_t badAcks;  // acknowledges with bad HMAC
+  uint16_t ackLatency;  // average time from transmission until acknowledge, ms
+  uint16_t maxAckLatency;
+  uint8_t payloadQueueHighWater;
+  uint8_t eventQueueHighWater;
+} SenderStats;
+static_assert(sizeof(struct senderStats) == 28, "sender stats structure does not have expected size");
+
+// Types of the events that are passed to the LoRa task.
+#define EVENT_INT 0
+#define EVENT_BOOLEAN 1
+#define EVENT_STRING 2
+#define EVENT_SYSTEM_MESSAGE 3
+#define EVENT_FLUSH 4
+#define EVENT_SLEEP 5
+
+typedef struct senderEvent {
+  uint8_t type;
+  uint16_t key;
+  int32_t value;
+  unsigned long time;  // millis() when the event was posted
+  char text[sizeof(((Payload *)0)->data)];
+} SenderEvent;
+
 /**
  * LoRa Sender
+ *
+ * The send methods only pass the event to the task that invokes loop(). They
+ * must always be invoked by the same task. The task only needs to invoke
+ * loop() when it is notified, or when the time returned by loop() has
+ * passed. Incoming packages and new events notify the task.
  */
 class LoRaSender {
 public:
@@ -74,17 +139,18 @@ public:
   void connect();
 
   /**
-   * Send an integer value.
+   * Send an integer value. The value may be suppressed by the integer filter.
+   * Values that are unchanged since the last acknowledgement are not sent.
    */
   void sendInt(uint16_t key, int32_t value);
 
   /**
-   * Send a boolean value.
+   * Send a boolean value, if it has changed since the last acknowledgement.
    */
   void sendBoolean(uint16_t key, bool value);
 
   /**
-   * Send a string.
+   * Send a string, if it has changed since the last acknowledgement.
    */
   void sendString(uint16_t key, String value);
 
@@ -104,23 +170,125 @@ public:
   void sleep();
 
   /**
-   * Invoked in main loop.
+   * Invoked in main loop of the LoRa task. Returns the number of ms until
+   * loop() needs to be invoked again, if the task is not notified earlier.
    */
-  void loop();
+  unsigned long loop();
 
+  /**
+   * Number of events that are waiting for the LoRa task.
+   */
+  size_t getEventQueueDepth();
+
+  /**
+   * Maximum number of events that have been waiting for the LoRa task.
+   */
+  size_t getEventQueueHighWater();
+
+  /**
+   * Number of events that were dropped because the event queue was full.
+   */
+  unsigned long getDroppedEventCount();
+
+  /**
+   * Average time between the radio signalling a received package and the
+   * LoRa task handling it, in us.
+   */
+  unsigned long getAverageWakeLatency();
+
+  /**
+   * Maximum time between the radio signalling a received package and the
+   * LoRa task handling it, in us.
+   */
+  unsigned long getMaxWakeLatency();
+
+  /**
+   * Number of payload transmissions, including retries.
+   */
+  unsigned long getSentCount();
+
+  /**
+   * Number of payload transmissions that were retries.
+   */
+  unsigned long getRetryCount();
+
+  /**
+   * Number of payloads that were dropped, because they were not acknowledged
+   * or the payload queue was full.
+   */
+  unsigned long getDroppedCount();
+
+  /**
+   * Number of acknowledges that were ignored because of a bad HMAC.
+   */
+  unsigned long getBadAckCount();
+
+  /**
+   * Average time between the transmission of a payload and its acknowledge,
+   * in ms.
+   */
+  unsigned long getAverageAckLatency();
+
+  /**
+   * Maximum time between the transmission of a payload and its acknowledge,
+   * in ms.
+   */
+  unsigned long getMaxAckLatency();
+
+  /**
+   * Maximum number of payloads that have been waiting for transmission.
+   */
+  size_t getPayloadQueueHighWater();
+
+  /**
+   * Total airtime of all transmissions, in ms.
+   */
+  unsigned long getAirtime();
+
+  /**
+   * Number of integer values that were suppressed by the filter.
+   */
+  unsigned long getSuppressedCount();
+
+  /**
+   * Number of suppressed integer values that were sent later, because the
+   * maximum silence was exceeded.
+   */
+  unsigned long getRefreshedCount();
 
 private:
+  void postEvent(SenderEvent &event);
+  void handleEvent(SenderEvent &event);
+  void handleInt(uint16_t key, int32_t value);
+  void handleBoolean(uint16_t key, bool value);
+  void handleString(uint16_t key, const char *value);
+  void handleSystemMessage(const char *message);
+  void handleSleep();
+  void flushPayload();
+  void encodeInt(uint16_t key, int32_t value);
   void sendMessage(uint8_t type, uint16_t key, uint8_t *msg, size_t length);
-  void sendRaw(Payload &payload);
+  Payload *openPayload();
+  size_t bufferedLength();
   void onLoRaReceive(int packetSize);
-  void encryptPayload(Payload &sendPayload);
+  void encryptPayload(QueuedPayload &queued);
   void transmitPayload();
-  boolean checkAcknowledge(uint8_t *ackPackage);
+  bool decryptAcknowledge(uint8_t *ackPackage, Acknowledge &unencrypted);
+  void startResync(uint16_t number);
+  void continueResync();
+  void acknowledgePayload(Payload &payload);
+  void sendStats();
+  unsigned long nextWakeup();
 
-  Payload payloadBuffer;
+  QueuedPayload *payloadBuffer;
+  QueuedPayload *currentPayload;
+  unsigned long currentEventTime;
 
-  cppQueue *senderQueue;
-  cppQueue *acknowledgeQueue;
+  ValueFilter *intFilter;
+  ValueCache *valueCache;
+  RingBuffer<SenderEvent, EVENT_BUFFER_SIZE> *eventQueue;
+  unsigned long droppedEventCount;
+  RingBuffer<QueuedPayload, PAYLOAD_BUFFER_SIZE> *senderQueue;
+  RingBuffer<ReceivedAcknowledge, PAYLOAD_BUFFER_SIZE> *acknowledgeQueue;
 
   bool validEncrypted;
   uint8_t currentEncrypted[sizeof(Payload)];
@@ -129,10 +297,32 @@ private:
   unsigned long lastPushTime;
   unsigned long lastSendTime;
   unsigned long nextSendDelay;
+  unsigned long lastPersistTime;
   uint8_t attempts;
+  bool receiving;
+
+  unsigned long wakeCount;
+  uint64_t totalWakeLatency;
+  unsigned long maxWakeLatency;
+
+  unsigned long sentCount;
+  unsigned long retryCount;
+  unsigned long droppedCount;
+  unsigned long badAckCount;
+  unsigned long ackCount;
+  uint64_t totalAckLatency;
+  unsigned long maxAckLatency;
+  unsigned long airtime;
+  unsigned long lastStatsTime;
+
+  bool resyncActive;
+  uint16_t resyncNumber;
+  size_t resyncCursor;
+  unsigned long lastResyncTime;
 
   uint8_t enckey[SHA256::HASH_SIZE];
   uint8_t mackey[SHA256::HASH_SIZE];
+  uint8_t ackkey[SHA256::HASH_SIZE];
   AES256 aesEncrypt;
   AES256 aesDecrypt;
   SHA256 hmacSha256;
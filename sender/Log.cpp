@@ -0,0 +1,359 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <atomic>
+
+#include "Log.h"
+
+// The log task runs at idle priority, so it only runs if no other task is
+// ready to run.
+#define LOG_TASK_PRIORITY tskIDLE_PRIORITY
+#define LOG_TASK_STACK_SIZE 4096
+
+// Interval in ms for checking for new log records.
+#define LOG_DRAIN_INTERVAL 20
+
+// Maximum length of a formatted log line.
+#define LOG_LINE_SIZE 256
+
+#define LOG_BUFFER_MASK (LOG_BUFFER_SIZE - 1)
+static_assert((LOG_BUFFER_SIZE & LOG_BUFFER_MASK) == 0, "LOG_BUFFER_SIZE must be a power of two");
+static_assert(LOG_ARGS_SIZE < 256, "LOG_ARGS_SIZE must fit into a byte");
+
+// Log records can be written by any task, so the buffer has a sequence number
+// per record that tells its state. It is relative to the lap of the position:
+// 0 is free, 1 is written, LOG_BUFFER_SIZE is free for the next lap. All
+// records are free initially.
+typedef struct logRecord {
+  std::atomic<uint32_t> sequence;
+  const char *format;
+  uint8_t length;
+  uint8_t args[LOG_ARGS_SIZE];
+} LogRecord;
+
+// Parsed conversion specification of a format string.
+typedef struct logSpec {
+  const char *start;   // the '%'
+  const char *end;     // behind the conversion character
+  char conversion;
+  char size;           // 'H' (hh), 'h', 'l', 'L' (ll), 'z', 't', 'j', or 0
+  bool widthArg;       // width is passed as argument
+  bool precisionArg;   // precision is passed as argument
+  int precision;       // -1 if not set in the format
+} LogSpec;
+
+static LogRecord records[LOG_BUFFER_SIZE];
+static std::atomic<uint32_t> writePosition(0);
+static uint32_t readPosition = 0;
+static std::atomic<unsigned long> droppedCount(0);
+
+static const char *parseSpec(const char *pos, LogSpec &spec) {
+  spec.start = pos++;
+  spec.size = 0;
+  spec.widthArg = false;
+  spec.precisionArg = false;
+  spec.precision = -1;
+
+  while (*pos != 0 && strchr("-+ #0", *pos) != NULL) {
+    pos++;
+  }
+  if (*pos == '*') {
+    spec.widthArg = true;
+    pos++;
+  }
+  while (isdigit(*pos)) {
+    pos++;
+  }
+  if (*pos == '.') {
+    pos++;
+    spec.precision = 0;
+    if (*pos == '*') {
+      spec.precisionArg = true;
+      pos++;
+    }
+    while (isdigit(*pos)) {
+      spec.precision = spec.precision * 10 + (*pos++ - '0');
+    }
+  }
+  if (*pos == 'h' || *pos == 'l') {
+    spec.size = *pos++;
+    if (*pos == spec.size) {
+      spec.size = spec.size == 'h' ? 'H' : 'L';
+      pos++;
+    }
+  } else if (*pos == 'z' || *pos == 't' || *pos == 'j') {
+    spec.size = *pos++;
+  }
+  spec.conversion = *pos;
+  if (*pos != 0) {
+    pos++;
+  }
+  spec.end = pos;
+  return pos;
+}
+
+static bool isInteger(char conversion) {
+  return conversion != 0 && strchr("diouxXc", conversion) != NULL;
+}
+
+static bool isFloat(char conversion) {
+  return conversion != 0 && strchr("fFeEgGaA", conversion) != NULL;
+}
+
+static bool put(LogRecord &record, const void *value, size_t size) {
+  if (record.length + size > LOG_ARGS_SIZE) {
+    return false;
+  }
+  memcpy(record.args + record.length, value, size);
+  record.length += size;
+  return true;
+}
+
+static bool encodeArgs(LogRecord &record, const char *format, va_list args) {
+  LogSpec spec;
+  const char *pos = format;
+  while ((pos = strchr(pos, '%')) != NULL) {
+    pos = parseSpec(pos, spec);
+
+    int precision = spec.precision;
+    if (spec.widthArg) {
+      int width = va_arg(args, int);
+      if (!put(record, &width, sizeof(width))) {
+        return false;
+      }
+    }
+    if (spec.precisionArg) {
+      precision = va_arg(args, int);
+      if (!put(record, &precision, sizeof(precision))) {
+        return false;
+      }
+    }
+
+    bool stored = true;
+    if (isInteger(spec.conversion)) {
+      if (spec.size == 'l') {
+        long value = va_arg(args, long);
+        stored = put(record, &value, sizeof(value));
+      } else if (spec.size == 'L' || spec.size == 'j') {
+        long long value = va_arg(args, long long);
+        stored = put(record, &value, sizeof(value));
+      } else if (spec.size == 'z') {
+        size_t value = va_arg(args, size_t);
+        stored = put(record, &value, sizeof(value));
+      } else if (spec.size == 't') {
+        ptrdiff_t value = va_arg(args, ptrdiff_t);
+        stored = put(record, &value, sizeof(value));
+      } else {
+        int value = va_arg(args, int);  // char and short are promoted to int
+        stored = put(record, &value, sizeof(value));
+      }
+    } else if (isFloat(spec.conversion)) {
+      double value = va_arg(args, double);
+      stored = put(record, &value, sizeof(value));
+    } else if (spec.conversion == 'p') {
+      void *value = va_arg(args, void *);
+      stored = put(record, &value, sizeof(value));
+    } else if (spec.conversion == 's') {
+      // The string is copied, as it may be gone when the record is printed.
+      // Strings limited by the precision do not need a null terminator.
+      const char *str = va_arg(args, const char *);
+      if (str == NULL) {
+        str = "(null)";
+      }
+      if (record.length >= LOG_ARGS_SIZE) {
+        return false;
+      }
+      size_t maxLength = LOG_ARGS_SIZE - record.length - 1;
+      if (precision >= 0 && (size_t)precision < maxLength) {
+        maxLength = precision;
+      }
+      uint8_t length = strnlen(str, maxLength);
+      record.args[record.length++] = length;
+      memcpy(record.args + record.length, str, length);
+      record.length += length;
+    }
+    if (!stored) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename T>
+static int formatValue(const LogRecord &record, size_t &in, char *line, size_t size, const char *format) {
+  T value;
+  if (in + sizeof(value) > record.length) {
+    return -1;
+  }
+  memcpy(&value, record.args + in, sizeof(value));
+  in += sizeof(value);
+  return snprintf(line, size, format, value);
+}
+
+static size_t formatRecord(const LogRecord &record, char *line, size_t size) {
+  LogSpec spec;
+  size_t out = 0;
+  size_t in = 0;
+  const char *pos = record.format;
+
+  while (*pos != 0 && out < size - 1) {
+    if (*pos != '%') {
+      line[out++] = *pos++;
+      continue;
+    }
+    pos = parseSpec(pos, spec);
+    if (spec.conversion == '%') {
+      line[out++] = '%';
+      continue;
+    }
+
+    // Rebuild the specification with the width and precision arguments
+    // inserted, so only the value itself needs to be passed
+    char format[24];
+    size_t formatLength = 0;
+    for (const char *ch = spec.start; ch < spec.end && formatLength < sizeof(format) - 12; ch++) {
+      if (*ch != '*') {
+        format[formatLength++] = *ch;
+        continue;
+      }
+      int value = 0;
+      if (in + sizeof(value) > record.length) {
+        break;
+      }
+      memcpy(&value, record.args + in, sizeof(value));
+      in += sizeof(value);
+      if (value >= 0 || ch[-1] != '.') {
+        formatLength += snprintf(format + formatLength, sizeof(format) - formatLength, "%d", value);
+      } else if (formatLength > 0) {
+        formatLength--;  // negative precision is ignored, remove the '.'
+      }
+    }
+    format[formatLength] = 0;
+
+    int written = -1;
+    if (isInteger(spec.conversion)) {
+      if (spec.size == 'l') {
+        written = formatValue<long>(record, in, line + out, size - out, format);
+      } else if (spec.size == 'L' || spec.size == 'j') {
+        written = formatValue<long long>(record, in, line + out, size - out, format);
+      } else if (spec.size == 'z') {
+        written = formatValue<size_t>(record, in, line + out, size - out, format);
+      } else if (spec.size == 't') {
+        written = formatValue<ptrdiff_t>(record, in, line + out, size - out, format);
+      } else {
+        written = formatValue<int>(record, in, line + out, size - out, format);
+      }
+    } else if (isFloat(spec.conversion)) {
+      written = formatValue<double>(record, in, line + out, size - out, format);
+    } else if (spec.conversion == 'p') {
+      written = formatValue<void *>(record, in, line + out, size - out, format);
+    } else if (spec.conversion == 's') {
+      if (in >= record.length || in + 1 + record.args[in] > record.length) {
+        break;
+      }
+      char str[LOG_ARGS_SIZE];
+      uint8_t length = record.args[in++];
+      memcpy(str, record.args + in, length);
+      str[length] = 0;
+      in += length;
+      written = snprintf(line + out, size - out, format, str);
+    }
+
+    if (written < 0) {
+      break;  // the record was truncated here
+    }
+    if (written > 0) {
+      out += min((size_t)written, size - 1 - out);
+    }
+  }
+
+  // Remove trailing line breaks, a new line is added anyway
+  while (out > 0 && (line[out - 1] == '\n' || line[out - 1] == '\r')) {
+    out--;
+  }
+  line[out] = 0;
+  return out;
+}
+
+static void logTask(void *parameter) {
+  char line[LOG_LINE_SIZE];
+  unsigned long reportedDropped = 0;
+
+  while (true) {
+    while (true) {
+      LogRecord &record = records[readPosition & LOG_BUFFER_MASK];
+      uint32_t lap = readPosition & ~LOG_BUFFER_MASK;
+      if (record.sequence.load(std::memory_order_acquire) != lap + 1) {
+        break;
+      }
+      formatRecord(record, line, sizeof(line));
+      record.sequence.store(lap + LOG_BUFFER_SIZE, std::memory_order_release);
+      readPosition++;
+      Serial.println(line);
+    }
+
+    unsigned long dropped = droppedCount.load(std::memory_order_relaxed);
+    if (dropped != reportedDropped) {
+      Serial.printf("LOG: %lu log records were dropped\n", dropped - reportedDropped);
+      reportedDropped = dropped;
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL));
+  }
+}
+
+void logBegin() {
+#if LOG_LEVEL > LOG_LEVEL_OFF
+  xTaskCreate(logTask, "log", LOG_TASK_STACK_SIZE, NULL, LOG_TASK_PRIORITY, NULL);
+#endif
+}
+
+void logWrite(const char *format, ...) {
+  // Claim the next free record
+  uint32_t position = writePosition.load(std::memory_order_relaxed);
+  LogRecord *record;
+  while (true) {
+    record = &records[position & LOG_BUFFER_MASK];
+    uint32_t lap = position & ~LOG_BUFFER_MASK;
+    int32_t state = (int32_t)(record->sequence.load(std::memory_order_acquire) - lap);
+    if (state == 0) {
+      if (writePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (state < 0) {
+      // The log task has not printed the record of the previous lap yet
+      droppedCount.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      position = writePosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  // Truncated arguments are just not printed
+  record->format = format;
+  record->length = 0;
+  va_list args;
+  va_start(args, format);
+  encodeArgs(*record, format, args);
+  va_end(args);
+
+  record->sequence.store((position & ~LOG_BUFFER_MASK) + 1, std::memory_order_release);
+}
+
+unsigned long logGetDroppedCount() {
+  return droppedCount.load(std::memory_order_relaxed);
+}
@@ -41,6 +41,15 @@ bool base64UrlDecode(const char *source, uint8_t *target, size_t targetSize) {
   return true;
 }
 
+unsigned long loraAirtime(size_t length, int spreading, long bandwidth) {
+  // See SX1276 datasheet, chapter 4.1.1.7. The LoRa library uses an explicit
+  // header, coding rate 4/5, a preamble of 8 symbols, and no CRC.
+  float symbolTime = (float)(1L << spreading) * 1000.0 / bandwidth;
+  int lowDataRate = symbolTime > 16.0 ? 1 : 0;
+  int payloadSymbols = 8 + max((int)ceil((8.0 * length - 4.0 * spreading + 28) / (4.0 * (spreading - 2 * lowDataRate))) * 5, 0);
+  return (unsigned long)((8 + 4.25 + payloadSymbols) * symbolTime);
+}
+
 String createRandomNonce() {
   uint8_t tokenBin[32];
   for (int ix = 0; ix < sizeof(tokenBin); ix++) {
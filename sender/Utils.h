@@ -36,6 +36,11 @@ void die(const char *message);
  */
 bool base64UrlDecode(const char *source, uint8_t *target, size_t targetSize);
 
+/**
+ * Time in ms that a LoRa package of the given length is on air.
+ */
+unsigned long loraAirtime(size_t length, int spreading, long bandwidth);
+
 /**
  * Create a random, 32 byte wide, base64url encoded nonce.
  */
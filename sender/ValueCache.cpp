@@ -0,0 +1,193 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#include "Log.h"
+#include "ValueCache.h"
+
+#define NVS_NAMESPACE "loracache"
+#define NVS_KEY "values"
+
+
+ValueCache::ValueCache(size_t capacity) {
+  this->capacity = capacity;
+  entries = new CacheEntry[capacity];
+  count = 0;
+  dirty = false;
+}
+
+ValueCache::~ValueCache() {
+  for (size_t ix = 0; ix < count; ix++) {
+    free(entries[ix].text);
+  }
+  delete[] entries;
+}
+
+bool ValueCache::isAcknowledged(uint16_t key, uint8_t type, int32_t value) {
+  CacheEntry *entry = find(key, false);
+  return entry != NULL
+         && entry->acknowledged
+         && entry->type == type
+         && entry->value == value
+         && entry->ackType == type
+         && entry->ackValue == value;
+}
+
+void ValueCache::queue(uint16_t key, uint8_t type, int32_t value, const char *text) {
+  CacheEntry *entry = find(key, true);
+  if (entry != NULL) {
+    if (entry->text != NULL && (text == NULL || entry->type != type || entry->value != value)) {
+      free(entry->text);
+      entry->text = NULL;
+    }
+    if (text != NULL && entry->text == NULL) {
+      entry->text = strdup(text);
+    }
+    entry->type = type;
+    entry->value = value;
+  }
+}
+
+size_t ValueCache::size() {
+  return count;
+}
+
+void ValueCache::get(size_t index, uint16_t &key, uint8_t &type, int32_t &value, const char *&text) {
+  CacheEntry &entry = entries[index];
+  key = entry.key;
+  type = entry.type;
+  value = entry.value;
+  text = entry.text;
+}
+
+void ValueCache::acknowledge(uint16_t key, uint8_t type, int32_t value) {
+  CacheEntry *entry = find(key, true);
+  if (entry != NULL) {
+    if (!entry->acknowledged || entry->ackType != type || entry->ackValue != value) {
+      dirty = true;
+    }
+    entry->acknowledged = true;
+    entry->ackType = type;
+    entry->ackValue = value;
+  }
+}
+
+ValueCache::CacheEntry *ValueCache::find(uint16_t key, bool create) {
+  // Entries are sorted by key, so a binary search can be used
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (entries[mid].key < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low < count && entries[low].key == key) {
+    return &entries[low];
+  }
+
+  if (!create || count >= capacity) {
+    return NULL;
+  }
+
+  memmove(&entries[low + 1], &entries[low], (count - low) * sizeof(CacheEntry));
+  count++;
+
+  CacheEntry &entry = entries[low];
+  entry.key = key;
+  entry.type = VALUE_TYPE_INT;
+  entry.value = 0;
+  entry.acknowledged = false;
+  entry.text = NULL;
+  return &entry;
+}
+
+void ValueCache::load() {
+  Preferences prefs;
+  if (!prefs.begin(NVS_NAMESPACE, true)) {
+    LOG_INFO("VC: No stored values found");
+    return;
+  }
+
+  size_t length = prefs.getBytesLength(NVS_KEY);
+  size_t storedCount = length / sizeof(StoredEntry);
+  if (storedCount > capacity) {
+    storedCount = capacity;
+  }
+
+  StoredEntry *stored = new StoredEntry[storedCount];
+  prefs.getBytes(NVS_KEY, stored, storedCount * sizeof(StoredEntry));
+  prefs.end();
+
+  size_t loadedCount = 0;
+  for (size_t ix = 0; ix < storedCount; ix++) {
+    // Only the hash of a string would be known, so it could neither be sent
+    // with a snapshot, nor be suppressed when the appliance sends it again
+    if (stored[ix].type == VALUE_TYPE_STRING) {
+      continue;
+    }
+    queue(stored[ix].key, stored[ix].type, stored[ix].value);
+    acknowledge(stored[ix].key, stored[ix].type, stored[ix].value);
+    loadedCount++;
+  }
+  delete[] stored;
+
+  dirty = false;
+  LOG_INFO("VC: Loaded %u stored values", loadedCount);
+}
+
+void ValueCache::save() {
+  if (!dirty) {
+    return;
+  }
+
+  StoredEntry *stored = new StoredEntry[count];
+  size_t storedCount = 0;
+  for (size_t ix = 0; ix < count; ix++) {
+    if (entries[ix].acknowledged && entries[ix].ackType != VALUE_TYPE_STRING) {
+      stored[storedCount].key = entries[ix].key;
+      stored[storedCount].type = entries[ix].ackType;
+      stored[storedCount].value = entries[ix].ackValue;
+      storedCount++;
+    }
+  }
+
+  Preferences prefs;
+  if (prefs.begin(NVS_NAMESPACE, false)) {
+    prefs.putBytes(NVS_KEY, stored, storedCount * sizeof(StoredEntry));
+    prefs.end();
+    dirty = false;
+  } else {
+    LOG_ERROR("VC: Could not store values");
+  }
+  delete[] stored;
+}
+
+int32_t ValueCache::hash(const char *str) {
+  // FNV-1a, it is good enough to detect changed strings
+  uint32_t result = 2166136261UL;
+  while (*str) {
+    result ^= (uint8_t)*str++;
+    result *= 16777619UL;
+  }
+  return (int32_t)result;
+}
@@ -0,0 +1,114 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __ValueCache__
+#define __ValueCache__
+
+#include <Arduino.h>
+
+
+#define VALUE_TYPE_INT 0
+#define VALUE_TYPE_BOOLEAN 1
+#define VALUE_TYPE_STRING 2
+
+/**
+ * Keeps the last value of every key that was queued for sending, and the last
+ * value that was acknowledged by the receiver. For strings, the hash is used as
+ * value, and only the most recently queued string is kept.
+ */
+class ValueCache {
+public:
+  /**
+   * Create a cache for the given maximum number of keys.
+   */
+  ValueCache(size_t capacity);
+
+  /**
+   * Destructor.
+   */
+  ~ValueCache();
+
+  /**
+   * Check if the receiver has acknowledged this value already, and no other
+   * value of that key is on its way.
+   */
+  bool isAcknowledged(uint16_t key, uint8_t type, int32_t value);
+
+  /**
+   * Remember that the value was queued for sending. For strings, the string
+   * itself is passed as text.
+   */
+  void queue(uint16_t key, uint8_t type, int32_t value, const char *text = NULL);
+
+  /**
+   * Remember that the value was acknowledged by the receiver.
+   */
+  void acknowledge(uint16_t key, uint8_t type, int32_t value);
+
+  /**
+   * Number of keys in the cache.
+   */
+  size_t size();
+
+  /**
+   * Get the most recently queued value of the entry at the given index. text
+   * is NULL if the entry is not a string, or if the string is unknown.
+   */
+  void get(size_t index, uint16_t &key, uint8_t &type, int32_t &value, const char *&text);
+
+  /**
+   * Load the acknowledged values from NVS. Strings are not stored, so they
+   * are always sent again after a restart.
+   */
+  void load();
+
+  /**
+   * Store the acknowledged values in NVS, if they have been changed.
+   */
+  void save();
+
+  /**
+   * Compute the hash of a string, for storing it in the cache.
+   */
+  static int32_t hash(const char *str);
+
+private:
+  typedef struct cacheEntry {
+    uint16_t key;
+    uint8_t type;
+    uint8_t ackType;
+    bool acknowledged;
+    int32_t value;
+    int32_t ackValue;
+    char *text;
+  } CacheEntry;
+
+  typedef struct storedEntry {
+    uint16_t key;
+    uint8_t type;
+    int32_t value;
+  } __attribute__((packed)) StoredEntry;
+
+  CacheEntry *find(uint16_t key, bool create);
+
+  CacheEntry *entries;
+  size_t count;
+  size_t capacity;
+  bool dirty;
+};
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <Arduino.h>
+
+#include "ValueFilter.h"
+
+
+ValueFilter::ValueFilter(const FilterRule *rules, size_t count, unsigned long maxSilence) {
+  this->rules = rules;
+  this->count = count;
+  this->maxSilence = maxSilence;
+  states = count > 0 ? new FilterState[count] : NULL;
+  reset();
+}
+
+ValueFilter::~ValueFilter() {
+  delete[] states;
+}
+
+void ValueFilter::reset() {
+  for (size_t ix = 0; ix < count; ix++) {
+    states[ix].sent = false;
+    states[ix].pending = false;
+  }
+  suppressedCount = 0;
+  refreshedCount = 0;
+}
+
+bool ValueFilter::accept(uint16_t key, int32_t value) {
+  for (size_t ix = 0; ix < count; ix++) {
+    if (rules[ix].key != key) {
+      continue;
+    }
+
+    FilterState &state = states[ix];
+    unsigned long now = millis();
+    if (!state.sent
+        || (now - state.lastTime) >= maxSilence
+        || isSignificant(rules[ix], state.lastValue, value)) {
+      state.sent = true;
+      state.pending = false;
+      state.lastValue = value;
+      state.lastTime = now;
+      return true;
+    }
+
+    if (value != state.lastValue) {
+      state.pending = true;
+      state.pendingValue = value;
+    } else {
+      state.pending = false;
+    }
+    suppressedCount++;
+    return false;
+  }
+
+  return true;
+}
+
+bool ValueFilter::poll(uint16_t &key, int32_t &value) {
+  unsigned long now = millis();
+  for (size_t ix = 0; ix < count; ix++) {
+    FilterState &state = states[ix];
+    if (state.pending && (now - state.lastTime) >= maxSilence) {
+      state.pending = false;
+      state.lastValue = state.pendingValue;
+      state.lastTime = now;
+      refreshedCount++;
+      key = rules[ix].key;
+      value = state.pendingValue;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ValueFilter::isSignificant(const FilterRule &rule, int32_t last, int32_t value) {
+  if (value == last) {
+    return false;
+  }
+
+  // Zero usually marks the end of a process, so it is always sent
+  if (value == 0) {
+    return true;
+  }
+
+  if (rule.quantum > 0 && quantize(value, rule.quantum) != quantize(last, rule.quantum)) {
+    return true;
+  }
+
+  if (rule.percent > 0) {
+    int64_t delta = (int64_t)value - last;
+    if (delta < 0) {
+      delta = -delta;
+    }
+    int64_t base = last < 0 ? -(int64_t)last : last;
+    if (delta * 100 >= base * rule.percent) {
+      return true;
+    }
+  }
+
+  return rule.quantum == 0 && rule.percent == 0;
+}
+
+int32_t ValueFilter::quantize(int32_t value, int32_t quantum) {
+  // Round towards negative infinity, so the boundaries are equidistant around zero
+  int32_t result = value / quantum;
+  if (value % quantum != 0 && value < 0) {
+    result--;
+  }
+  return result;
+}
+
+unsigned long ValueFilter::getSuppressedCount() {
+  return suppressedCount;
+}
+
+unsigned long ValueFilter::getRefreshedCount() {
+  return refreshedCount;
+}
@@ -0,0 +1,96 @@
+/*
+ * LoRa-Connect
+ *
+ * Copyright (C) 2023 Richard "Shred" Körber
+ *   https://codeberg.org/shred/lora-connect
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __ValueFilter__
+#define __ValueFilter__
+
+#include <Arduino.h>
+
+
+typedef struct filterRule {
+  uint16_t key;      // uid of the value to be filtered
+  int32_t quantum;   // only send if a multiple of quantum was crossed, 0 = off
+  uint8_t percent;   // only send if the value changed by this percentage, 0 = off
+} FilterRule;
+
+/**
+ * Deadband and quantization filter for integer values. Values of keys without
+ * a rule are always passed.
+ */
+class ValueFilter {
+public:
+  /**
+   * Create a filter with the given rules. A suppressed value is sent anyway if
+   * the last value of that key was sent more than maxSilence ms ago.
+   */
+  ValueFilter(const FilterRule *rules, size_t count, unsigned long maxSilence);
+
+  /**
+   * Destructor.
+   */
+  ~ValueFilter();
+
+  /**
+   * Check if the value is to be sent now. If false is returned, the value
+   * was suppressed and is kept until the maximum silence is exceeded.
+   */
+  bool accept(uint16_t key, int32_t value);
+
+  /**
+   * Get a suppressed value that needs to be sent because the maximum silence
+   * was exceeded. Returns false if there is no such value.
+   */
+  bool poll(uint16_t &key, int32_t &value);
+
+  /**
+   * Forget all sent values, so the next value of every key is passed.
+   */
+  void reset();
+
+  /**
+   * Number of values that have been suppressed.
+   */
+  unsigned long getSuppressedCount();
+
+  /**
+   * Number of suppressed values that have been sent later, after the maximum
+   * silence was exceeded.
+   */
+  unsigned long getRefreshedCount();
+
+private:
+  typedef struct filterState {
+    bool sent;
+    bool pending;
+    int32_t lastValue;
+    int32_t pendingValue;
+    unsigned long lastTime;
+  } FilterState;
+
+  bool isSignificant(const FilterRule &rule, int32_t last, int32_t value);
+  int32_t quantize(int32_t value, int32_t quantum);
+
+  const FilterRule *rules;
+  FilterState *states;
+  size_t count;
+  unsigned long maxSilence;
+
+  unsigned long suppressedCount;
+  unsigned long refreshedCount;
+};
+
+#endif
@@ -16,14 +16,34 @@
  */
 
 #include <WiFi.h>
+#include <esp_pm.h>
 
 #include "HCSocket.h"
+#include "Log.h"
 #include "LoRaSender.h"
 #include "Utils.h"
 #include "config.h"
 
 #define LED_PIN 25
 
+// The socket task shares core 0 with the WiFi stack, the LoRa task runs on core 1
+#define SOCKET_TASK_CORE 0
+#define LORA_TASK_CORE 1
+#define SOCKET_TASK_STACK_SIZE 8192
+#define LORA_TASK_STACK_SIZE 4096
+#define TASK_PRIORITY 1
+
+// While the appliance is connected, the socket is polled at this interval (ms)
+#define SOCKET_POLL_INTERVAL 10
+
+// Interval for logging the task statistics
+#define STATS_INTERVAL 60000
+
+typedef struct apEvent {
+  WiFiEvent_t event;
+  WiFiEventInfo_t info;
+} ApEvent;
+
 // AP connection
 bool apGate = false;
 bool deviceConnected = false;
@@ -39,24 +59,29 @@ HCSocket socket(HC_APPLIANCE_KEY, HC_APPLIANCE_IV, processMessage);
 // LoRa
 LoRaSender lora(LORA_ENCRYPT_KEY);
 
+// Tasks
+QueueHandle_t apEventQueue;
+volatile unsigned long socketTaskTime = 0;
+volatile unsigned long loraTaskTime = 0;
+
 void WiFiApConnected(WiFiEvent_t event, WiFiEventInfo_t info) {
-  Serial.printf("Connection attempt (AID %u, MAC %02X:%02X:%02X:%02X:%02X:%02X)\n",
-                info.wifi_ap_staconnected.aid,
-                info.wifi_ap_staconnected.mac[0],
-                info.wifi_ap_staconnected.mac[1],
-                info.wifi_ap_staconnected.mac[2],
-                info.wifi_ap_staconnected.mac[3],
-                info.wifi_ap_staconnected.mac[4],
-                info.wifi_ap_staconnected.mac[5]);
+  LOG_INFO("Connection attempt (AID %u, MAC %02X:%02X:%02X:%02X:%02X:%02X)",
+           info.wifi_ap_staconnected.aid,
+           info.wifi_ap_staconnected.mac[0],
+           info.wifi_ap_staconnected.mac[1],
+           info.wifi_ap_staconnected.mac[2],
+           info.wifi_ap_staconnected.mac[3],
+           info.wifi_ap_staconnected.mac[4],
+           info.wifi_ap_staconnected.mac[5]);
   if (0 == memcmp(info.wifi_ap_staconnected.mac, expectedMac, sizeof(expectedMac))) {
     deviceConnected = false;
     deviceAid = info.wifi_ap_staconnected.aid;
     apGate = true;
-    Serial.println("Appliance is connected");
+    LOG_INFO("Appliance is connected");
     lora.sendSystemMessage("Appliance connected");
   } else {
     apGate = false;
-    Serial.println("Ignored unregistered device");
+    LOG_WARN("Ignored unregistered device");
     lora.sendSystemMessage("Unknown device connected");
   }
 }
@@ -66,7 +91,7 @@ void WiFiApIpAssigned(WiFiEvent_t event, WiFiEventInfo_t info) {
     deviceIp = IPAddress(info.wifi_ap_staipassigned.ip.addr);
     deviceConnected = true;
     apGate = false;
-    Serial.printf("Assigned IP %s to AID %u\n", deviceIp.toString(), deviceAid);
+    LOG_INFO("Assigned IP %s to AID %u", deviceIp.toString().c_str(), deviceAid);
     socket.connect(deviceIp, 80);
     lora.sendSystemMessage("Appliance IP " + deviceIp.toString());
     digitalWrite(LED_PIN, HIGH);
@@ -78,16 +103,15 @@ void WiFiApDisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
     deviceConnected = false;
     apGate = false;
     lora.sendSystemMessage("Appliance disconnected");
-    Serial.printf("Appliance disconnected, AID %u\n", deviceAid);
+    LOG_INFO("Appliance disconnected, AID %u", deviceAid);
     digitalWrite(LED_PIN, LOW);
     lora.sleep();
   }
 }
 
 void processMessage(const JsonDocument &msg) {
-  Serial.println("Received an event");
-  serializeJson(msg, Serial);
-  Serial.println();
+  // Only the frame type is logged, the values are logged by LoRaSender
+  LOG_DEBUG("Received %s %s", msg["action"].as<const char *>(), msg["resource"].as<const char *>());
 
   if ((msg["action"] == "NOTIFY" && msg["resource"] == "/ro/values")
       || (msg["action"] == "RESPONSE" && msg["resource"] == "/ro/allMandatoryValues")) {
@@ -103,7 +127,7 @@ void processMessage(const JsonDocument &msg) {
       } else if (row["value"].is<const char *>()) {
         lora.sendString(uid, row["value"]);
       } else {
-        Serial.printf("Don't know how to send uid %u\n", uid);
+        LOG_WARN("Don't know how to send uid %u", uid);
       }
     }
 #ifndef LORA_COLLECT_TIME
@@ -136,9 +160,90 @@ void processMessage(const JsonDocument &msg) {
   }
 }
 
+void onWiFiApEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+  // AP events are handled by the socket task, so only a single task is
+  // passing events to LoRaSender.
+  ApEvent apEvent;
+  apEvent.event = event;
+  apEvent.info = info;
+  if (xQueueSend(apEventQueue, &apEvent, 0) != pdTRUE) {
+    LOG_ERROR("AP event queue is full, event was dropped!");
+  }
+}
+
+void handleApEvent(ApEvent &apEvent) {
+  switch (apEvent.event) {
+    case WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STACONNECTED:
+      WiFiApConnected(apEvent.event, apEvent.info);
+      break;
+
+    case WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STADISCONNECTED:
+      WiFiApDisconnected(apEvent.event, apEvent.info);
+      break;
+
+    case WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED:
+      WiFiApIpAssigned(apEvent.event, apEvent.info);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void socketTask(void *parameter) {
+  ApEvent apEvent;
+  while (true) {
+    // Sleep until an AP event arrives. The socket library cannot signal
+    // incoming data, so it is polled while the appliance is connected.
+    TickType_t timeout = deviceConnected ? pdMS_TO_TICKS(SOCKET_POLL_INTERVAL) : portMAX_DELAY;
+    bool received = xQueueReceive(apEventQueue, &apEvent, timeout) == pdTRUE;
+
+    unsigned long start = micros();
+    while (received) {
+      handleApEvent(apEvent);
+      received = xQueueReceive(apEventQueue, &apEvent, 0) == pdTRUE;
+    }
+    socket.loop();
+    socketTaskTime += micros() - start;
+  }
+}
+
+void loraTask(void *parameter) {
+  while (true) {
+    unsigned long start = micros();
+    unsigned long timeout = lora.loop();
+    loraTaskTime += micros() - start;
+
+    // Sleep until the radio or a new event wakes us up, or the next timer is
+    // due. Wait at least one tick, so other tasks can run.
+    TickType_t ticks = pdMS_TO_TICKS(timeout);
+    ulTaskNotifyTake(pdTRUE, ticks > 0 ? ticks : 1);
+  }
+}
+
+void enablePowerSave() {
+#ifdef POWER_SAVE
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t pmConfig;
+  // The access point keeps the WiFi radio awake, so the sender cannot use
+  // light sleep. Only the CPU clock is scaled down while idle.
+  pmConfig.max_freq_mhz = 240;
+  pmConfig.min_freq_mhz = 80;
+  pmConfig.light_sleep_enable = false;
+  esp_err_t err = esp_pm_configure(&pmConfig);
+  if (err != ESP_OK) {
+    LOG_ERROR("Power saving could not be enabled, error %d", err);
+  }
+#else
+  LOG_WARN("Power management is not supported by this build, POWER_SAVE is ignored");
+#endif
+#endif
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println();
+  logBegin();
 
   // Turn LED off
   pinMode(LED_PIN, OUTPUT);
@@ -147,22 +252,54 @@ void setup() {
   // Seed random generator
   randomSeed(analogRead(0));
 
+  enablePowerSave();
+
   // Start AP
-  Serial.println("Starting Access Point");
+  LOG_INFO("Starting Access Point");
+  apEventQueue = xQueueCreate(8, sizeof(ApEvent));
   WiFi.disconnect(true);
   WiFi.softAP(AP_SSID, AP_PASSWORD, AP_CHANNEL, AP_SSID_HIDDEN);
-  WiFi.onEvent(WiFiApConnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STACONNECTED);
-  WiFi.onEvent(WiFiApDisconnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STADISCONNECTED);
-  WiFi.onEvent(WiFiApIpAssigned, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED);
+  WiFi.onEvent(onWiFiApEvent, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STACONNECTED);
+  WiFi.onEvent(onWiFiApEvent, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STADISCONNECTED);
+  WiFi.onEvent(onWiFiApEvent, WiFiEvent_t::ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED);
 
   // Start LoRa
   lora.connect();
 
   // Send startup message
   lora.sendSystemMessage("Ready");
+
+  // Start tasks
+  xTaskCreatePinnedToCore(loraTask, "lora", LORA_TASK_STACK_SIZE, NULL, TASK_PRIORITY, NULL, LORA_TASK_CORE);
+  xTaskCreatePinnedToCore(socketTask, "socket", SOCKET_TASK_STACK_SIZE, NULL, TASK_PRIORITY, NULL, SOCKET_TASK_CORE);
 }
 
 void loop() {
-  socket.loop();
-  lora.loop();
+  // The work is done by the tasks, we only log statistics here
+  unsigned long lastSocketTime = socketTaskTime;
+  unsigned long lastLoraTime = loraTaskTime;
+  unsigned long start = micros();
+  delay(STATS_INTERVAL);
+  unsigned long elapsed = micros() - start;
+
+  LOG_INFO("ST: socket task %lu%% CPU, LoRa task %lu%% CPU, event queue %u (max %u), %lu events dropped, wake latency %lu us (max %lu us)",
+           (unsigned long)((uint64_t)(socketTaskTime - lastSocketTime) * 100 / elapsed),
+           (unsigned long)((uint64_t)(loraTaskTime - lastLoraTime) * 100 / elapsed),
+           lora.getEventQueueDepth(),
+           lora.getEventQueueHighWater(),
+           lora.getDroppedEventCount(),
+           lora.getAverageWakeLatency(),
+           lora.getMaxWakeLatency());
+  LOG_INFO("ST: LoRa %lu sent, %lu retried, %lu dropped, %lu bad acks, ack latency %lu ms (max %lu ms), payload queue max %u, airtime %lu ms",
+           lora.getSentCount(),
+           lora.getRetryCount(),
+           lora.getDroppedCount(),
+           lora.getBadAckCount(),
+           lora.getAverageAckLatency(),
+           lora.getMaxAckLatency(),
+           lora.getPayloadQueueHighWater(),
+           lora.getAirtime());
+  LOG_INFO("ST: Filter %lu values suppressed, %lu refreshed",
+           lora.getSuppressedCount(),
+           lora.getRefreshedCount());
 }